@@ -0,0 +1,171 @@
+//
+// Created by zelin on 2022/6/20.
+//
+// helpers shared by the benchmarks: timing, percentiles, allocation counting
+// and the json report.
+//
+// the report is one json object per run:
+//   {"bench":"benchpool","results":[{"name":..,"params":{..},"values":{..}}, ..]}
+// values are numbers, so two reports can be diffed key by key.
+
+#ifndef EVENT_MANAGER_BENCH_H
+#define EVENT_MANAGER_BENCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+using bench_clock = std::chrono::steady_clock;
+
+inline uint64_t bench_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            bench_clock::now().time_since_epoch()).count();
+}
+
+/// spin (then yield) until \p pred holds or \p timeout_ms passes
+template <typename Pred>
+bool bench_wait(Pred pred, const int timeout_ms = 10000) {
+    auto end = bench_clock::now() + std::chrono::milliseconds(timeout_ms);
+    while (!pred()) {
+        if (bench_clock::now() > end)
+            return false;
+        std::this_thread::yield();
+    }
+    return true;
+}
+
+/// exact percentiles of a sample set
+struct bench_samples {
+    std::vector<uint64_t> v;
+
+    void add(const uint64_t x) { v.push_back(x); }
+
+    /// \p p in [0, 1], sorts on first use
+    uint64_t pct(const double p) {
+        if (v.empty())
+            return 0;
+        if (!sorted_) {
+            std::sort(v.begin(), v.end());
+            sorted_ = true;
+        }
+        return v[std::min(v.size() - 1, size_t(p * (v.size() - 1) + 0.5))];
+    }
+
+private:
+    bool sorted_ = false;
+};
+
+/// counts operator new calls when the binary includes bench_alloc.h
+struct bench_alloc {
+    inline static std::atomic<uint64_t> count{0};
+    inline static std::atomic<uint64_t> bytes{0};
+};
+
+/// one result line of the report
+struct bench_result {
+    std::string name;
+    std::vector<std::pair<std::string, double>> params;
+    std::vector<std::pair<std::string, double>> values;
+
+    bench_result& param(const std::string& k, const double v) {
+        params.emplace_back(k, v);
+        return *this;
+    }
+    bench_result& value(const std::string& k, const double v) {
+        values.emplace_back(k, v);
+        return *this;
+    }
+    bench_result& latency(const std::string& prefix, bench_samples& s) {
+        value(prefix + "_p50_ns", s.pct(0.5));
+        value(prefix + "_p90_ns", s.pct(0.9));
+        value(prefix + "_p99_ns", s.pct(0.99));
+        value(prefix + "_p999_ns", s.pct(0.999));
+        value(prefix + "_max_ns", s.pct(1));
+        return *this;
+    }
+};
+
+/// collects results, prints them as they come and writes the json report
+class bench_report {
+private:
+    std::string bench_;
+    std::vector<bench_result> results_;
+public:
+    explicit bench_report(std::string bench) : bench_(std::move(bench)) {}
+
+    void add(const bench_result& r) {
+        printf("%-24s", r.name.c_str());
+        for (auto& p : r.params) {
+            printf(" %s=%g", p.first.c_str(), p.second);
+        }
+        printf(" |");
+        for (auto& v : r.values) {
+            printf(" %s=%.4g", v.first.c_str(), v.second);
+        }
+        printf("\n");
+        fflush(stdout);
+        results_.push_back(r);
+    }
+
+    std::string json() const {
+        std::string out = "{\"bench\":\"" + bench_ + "\",\"results\":[";
+        char buf[64];
+        auto obj = [&buf](const std::vector<std::pair<std::string, double>>& kv) {
+            std::string o = "{";
+            for (size_t i=0; i<kv.size(); ++i) {
+                snprintf(buf, sizeof(buf), "%.6g", kv[i].second);
+                o += (i ? ",\"" : "\"") + kv[i].first + "\":" + buf;
+            }
+            return o + "}";
+        };
+        for (size_t i=0; i<results_.size(); ++i) {
+            out += i ? ",\n" : "\n";
+            out += "{\"name\":\"" + results_[i].name + "\",\"params\":" +
+                   obj(results_[i].params) + ",\"values\":" + obj(results_[i].values) + "}";
+        }
+        return out + "\n]}\n";
+    }
+
+    /// \return 0 on success
+    int write(const std::string& path) const {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f)
+            return -1;
+        auto s = json();
+        fwrite(s.data(), 1, s.size(), f);
+        return fclose(f) ? -1 : 0;
+    }
+};
+
+/// common command line: [--quick] [--json file] [suite ...]
+struct bench_args {
+    bool quick = false;
+    std::string json;
+    std::vector<std::string> suites;
+
+    bench_args(int argc, char** argv) {
+        for (int i=1; i<argc; ++i) {
+            if (!strcmp(argv[i], "--quick"))
+                quick = true;
+            else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+                json = argv[++i];
+            else
+                suites.emplace_back(argv[i]);
+        }
+    }
+
+    bool run(const std::string& suite) const {
+        return suites.empty() || std::find(suites.begin(), suites.end(), suite) != suites.end();
+    }
+};
+
+#endif //EVENT_MANAGER_BENCH_H
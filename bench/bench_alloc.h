@@ -0,0 +1,86 @@
+//
+// Created by zelin on 2022/6/20.
+//
+// replaces the global operator new/delete to count allocations into
+// bench_alloc, include it in exactly one file of a benchmark binary.
+// every operator new has its operator delete here, the plain and the
+// aligned ones each go through one function, kept out of line so the
+// compiler never pairs an inlined free() with a call to operator new.
+
+#ifndef EVENT_MANAGER_BENCH_ALLOC_H
+#define EVENT_MANAGER_BENCH_ALLOC_H
+
+#include "bench.h"
+
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+
+[[gnu::noinline]] static void* counted_alloc(size_t size, const size_t align) {
+    bench_alloc::count.fetch_add(1, std::memory_order_relaxed);
+    bench_alloc::bytes.fetch_add(size, std::memory_order_relaxed);
+    if (!size)
+        size = 1;
+    void* p = nullptr;
+    if (align <= alignof(std::max_align_t))
+        p = malloc(size);
+    else if (posix_memalign(&p, align, size))
+        p = nullptr;
+    if (p)
+        return p;
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] static void counted_free(void* p) noexcept {
+    free(p);
+}
+
+void* operator new(size_t size) {
+    return counted_alloc(size, 0);
+}
+
+void* operator new[](size_t size) {
+    return counted_alloc(size, 0);
+}
+
+void* operator new(size_t size, std::align_val_t align) {
+    return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void* operator new[](size_t size, std::align_val_t align) {
+    return counted_alloc(size, static_cast<size_t>(align));
+}
+
+void operator delete(void* p) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete(void* p, size_t, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t) noexcept {
+    counted_free(p);
+}
+
+#endif //EVENT_MANAGER_BENCH_ALLOC_H
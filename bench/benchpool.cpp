@@ -0,0 +1,378 @@
+//
+// Created by zelin on 2022/6/20.
+//
+// event_pool benchmarks.
+//
+// usage: benchpool [--quick] [--json report.json] [suite ...]
+// suites:
+//   throughput  triggers/s by producer x worker count, the scaling curves
+//   staged      throughput with the producers staging 64 triggers at a time
+//   latency     trigger -> handler start, one trigger in flight at a time
+//   openloop    fixed arrival rate, latency measured from the intended send
+//               time, so a stalled producer does not hide the queueing it
+//               causes (coordinated omission), the uncorrected one for reference
+//   lookup      producer side cost of a trigger by registry size, hit and miss
+//   alloc       heap allocations per trigger
+//   consume     worker side cost of a tiny task: the queue is filled while the
+//               worker is held, then drained
+//   record      producer cost of recording the triggers, and replaying the
+//               log as fast as it goes
+//   expiry      overload of 10us handlers with a 1ms deadline, the triggers
+//               skipped and the handler time that saved
+//   failing     throughput with a share of the handlers throwing, caught by
+//               the workers
+#include "bench.h"
+#include "bench_alloc.h"
+#include "event_pool.h"
+
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <unistd.h>
+
+static void throughput(bench_report& report, const bool quick, const bool staged = false) {
+    const uint64_t n = quick ? 20000 : 1000000;
+    const std::vector<size_t> counts = quick ? std::vector<size_t>{1, 2}
+                                             : std::vector<size_t>{1, 2, 4, 8};
+    for (size_t workers : counts) {
+        for (size_t producers : counts) {
+            std::atomic<uint64_t> done{0};
+            event_pool ep(workers);
+            ep.register_callback("tick", [&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+
+            std::atomic_bool go{false};
+            std::vector<std::thread> threads;
+            for (size_t p=0; p<producers; ++p) {
+                threads.emplace_back([&ep, &go, n, producers, staged]() {
+                    if (staged)
+                        ep.stage_this_thread(64);
+                    while (!go) {}
+                    for (uint64_t i=0; i<n / producers; ++i) {
+                        ep.trigger_callback("tick");
+                    }
+                    ep.flush();
+                });
+            }
+            uint64_t total = n / producers * producers;
+            auto start = bench_clock::now();
+            go = true;
+            for (auto& t : threads) {
+                t.join();
+            }
+            bench_wait([&done, total]() { return done.load() >= total; }, 60000);
+            double sec = std::chrono::duration<double>(bench_clock::now() - start).count();
+            report.add(bench_result{staged ? "staged" : "throughput"}
+                           .param("workers", workers)
+                           .param("producers", producers)
+                           .value("triggers_per_sec", done / sec)
+                           .value("ns_per_trigger", sec * 1e9 / done));
+        }
+    }
+}
+
+static void latency(bench_report& report, const bool quick) {
+    const size_t n = quick ? 2000 : 100000;
+    for (size_t workers : {size_t(1), size_t(4)}) {
+        event_pool ep(workers);
+        std::atomic<uint64_t> lat{0};
+        std::atomic_bool ran{false};
+        ep.register_callback("lat", [&lat, &ran](uint64_t sent) {
+            lat.store(bench_now_ns() - sent, std::memory_order_relaxed);
+            ran.store(true, std::memory_order_release);
+        }, uint64_t());
+
+        bench_samples s;
+        for (size_t i=0; i<n; ++i) {
+            ran = false;
+            ep.trigger_callback("lat", bench_now_ns());
+            if (!bench_wait([&ran]() { return ran.load(std::memory_order_acquire); }))
+                break;
+            s.add(lat.load(std::memory_order_relaxed));
+        }
+        report.add(bench_result{"latency"}
+                       .param("workers", workers)
+                       .latency("trigger_to_run", s));
+    }
+}
+
+static void openloop(bench_report& report, const bool quick) {
+    const double seconds = quick ? 0.2 : 2;
+    const std::vector<double> rates = quick ? std::vector<double>{10000, 50000}
+                                            : std::vector<double>{10000, 100000, 300000, 1000000};
+    for (double rate : rates) {
+        const auto n = static_cast<size_t>(rate * seconds);
+        std::unique_ptr<uint64_t[]> corrected(new uint64_t[n]());
+        std::unique_ptr<uint64_t[]> uncorrected(new uint64_t[n]());
+        std::atomic<size_t> done{0};
+
+        event_pool ep(2);
+        ep.register_callback("req", [&](uint64_t i, uint64_t intended, uint64_t sent) {
+            uint64_t now = bench_now_ns();
+            corrected[i] = now - intended;
+            uncorrected[i] = now - sent;
+            done.fetch_add(1, std::memory_order_relaxed);
+        }, uint64_t(), uint64_t(), uint64_t());
+
+        const double interval = 1e9 / rate;
+        uint64_t start = bench_now_ns();
+        size_t late = 0;
+        for (size_t i=0; i<n; ++i) {
+            auto intended = start + static_cast<uint64_t>(i * interval);
+            uint64_t now = bench_now_ns();
+            if (now < intended) {
+                while ((now = bench_now_ns()) < intended) {}
+            } else if (now - intended > 1000000) {
+                ++late;     // the producer itself fell behind by over 1ms
+            }
+            ep.trigger_callback("req", uint64_t(i), intended, now);
+        }
+        bench_wait([&done, n]() { return done.load() >= n; }, 60000);
+        double achieved = n / ((bench_now_ns() - start) / 1e9);
+
+        bench_samples c, u;
+        for (size_t i=0; i<done.load(); ++i) {
+            c.add(corrected[i]);
+            u.add(uncorrected[i]);
+        }
+        report.add(bench_result{"openloop"}
+                       .param("rate", rate)
+                       .param("workers", 2)
+                       .value("achieved_per_sec", achieved)
+                       .value("late_sends", late)
+                       .latency("corrected", c)
+                       .latency("uncorrected", u));
+    }
+}
+
+static void lookup(bench_report& report, const bool quick) {
+    const size_t ops = quick ? 50000 : 2000000;
+    for (size_t size : {size_t(1000), size_t(100000)}) {
+        if (quick && size > 1000)
+            break;
+        std::atomic<uint64_t> done{0};
+        event_pool ep(1);
+        std::vector<std::string> ids, misses;
+        for (size_t i=0; i<size; ++i) {
+            ids.push_back("sensor." + std::to_string(i) + ".temperature");
+            misses.push_back("sensor." + std::to_string(i) + ".humidity");
+            ep.register_callback(ids.back(), [&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+        }
+        std::mt19937 rng(42);
+        std::vector<uint32_t> order(ops);
+        for (auto& o : order) {
+            o = rng() % size;
+        }
+
+        uint64_t start = bench_now_ns();
+        for (auto o : order) {
+            ep.trigger_callback(misses[o]);
+        }
+        double miss_ns = double(bench_now_ns() - start) / ops;
+
+        start = bench_now_ns();
+        for (auto o : order) {
+            ep.trigger_callback(ids[o]);
+        }
+        double hit_ns = double(bench_now_ns() - start) / ops;
+        bench_wait([&done, ops]() { return done.load() >= ops; }, 60000);
+
+        report.add(bench_result{"lookup"}
+                       .param("registered", size)
+                       .value("miss_ns", miss_ns)
+                       .value("trigger_ns", hit_ns));
+    }
+}
+
+static void alloc(bench_report& report, const bool quick) {
+    const size_t n = quick ? 1000 : 100000;
+    std::atomic<uint64_t> done{0};
+    event_pool ep(1);
+    ep.register_callback("noarg", [&done]() { done.fetch_add(1, std::memory_order_relaxed); });
+    ep.register_callback("arg", [&done](int) { done.fetch_add(1, std::memory_order_relaxed); }, 0);
+
+    auto measure = [&](const char* name, auto trigger) {
+        done = 0;
+        uint64_t count = bench_alloc::count.load();
+        uint64_t bytes = bench_alloc::bytes.load();
+        for (size_t i=0; i<n; ++i) {
+            trigger(i);
+        }
+        bench_wait([&done, n]() { return done.load() >= n; });
+        report.add(bench_result{std::string("alloc_") + name}
+                       .value("allocs_per_trigger", double(bench_alloc::count.load() - count) / n)
+                       .value("bytes_per_trigger", double(bench_alloc::bytes.load() - bytes) / n));
+    };
+    measure("trigger_noarg", [&ep](size_t) { ep.trigger_callback("noarg"); });
+    measure("trigger_arg", [&ep](size_t i) { ep.trigger_callback("arg", int(i)); });
+    measure("trigger_and_set", [&ep](size_t i) { ep.trigger_and_set("arg", int(i)); });
+    // at most 1000 queued, within the versions the registered handle keeps
+    measure("trigger_and_set_1k", [&ep, &done](size_t i) {
+        if (i % 1000 == 0)
+            bench_wait([&done, i]() { return done.load() >= i; });
+        ep.trigger_and_set("arg", int(i));
+    });
+}
+
+static void consume(bench_report& report, const bool quick) {
+    const size_t n = quick ? 100000 : 2000000;
+    for (size_t workers : {size_t(1), size_t(2)}) {
+        std::atomic<uint64_t> done{0};
+        std::atomic_bool hold{true};
+        ThreadPool tp(workers);
+        for (size_t w=0; w<workers; ++w) {
+            tp.add_task([&hold]() { while (hold) {} });
+        }
+        bench_wait([&tp, workers]() {
+            auto ws = tp.stats();
+            size_t held = 0;
+            for (auto& w : ws) {
+                held += w.queue_depth;
+            }
+            return held == workers;
+        });
+        auto tick = std::make_shared<handle<void()>>([&done]() {
+            done.fetch_add(1, std::memory_order_relaxed);
+        });
+        for (size_t i=0; i<n; ++i) {
+            tp.add_task(tick);
+        }
+        uint64_t start = bench_now_ns();
+        hold = false;
+        bench_wait([&done, n]() { return done.load() >= n; }, 60000);
+        double ns = double(bench_now_ns() - start) / n;
+        report.add(bench_result{"consume"}
+                       .param("workers", workers)
+                       .value("ns_per_task", ns)
+                       .value("tasks_per_sec", 1e9 / ns));
+    }
+}
+
+static void record(bench_report& report, const bool quick) {
+    const size_t n = quick ? 20000 : 1000000;
+    char path[] = "/tmp/benchpool.log.XXXXXX";
+    int fd = mkstemp(path);
+    if (fd < 0)
+        return;
+    close(fd);
+    for (int recording=0; recording<2; ++recording) {
+        std::atomic<uint64_t> done{0};
+        event_pool ep(2);
+        ep.register_callback("req", [&done](uint64_t) { done.fetch_add(1, std::memory_order_relaxed); },
+                             uint64_t());
+        if (recording)
+            ep.record(path, n * 64);
+        uint64_t start = bench_now_ns();
+        for (size_t i=0; i<n; ++i) {
+            ep.trigger_callback("req", uint64_t(i));
+        }
+        double ns = double(bench_now_ns() - start) / n;
+        bench_wait([&done, n]() { return done.load() >= n; }, 60000);
+        report.add(bench_result{"record"}
+                       .param("recording", recording)
+                       .value("trigger_ns", ns));
+    }
+    std::atomic<uint64_t> done{0};
+    {
+        event_pool ep(2);
+        ep.register_callback("req", [&done](uint64_t) { done.fetch_add(1, std::memory_order_relaxed); },
+                             uint64_t());
+        uint64_t start = bench_now_ns();
+        int64_t replayed = ep.replay(path, 0);
+        bench_wait([&done, replayed]() { return int64_t(done.load()) >= replayed; }, 60000);
+        report.add(bench_result{"replay"}
+                       .param("speed", 0)
+                       .value("triggers", double(replayed))
+                       .value("triggers_per_sec", replayed / ((bench_now_ns() - start) / 1e9)));
+    }
+    unlink(path);
+}
+
+static void expiry(bench_report& report, const bool quick) {
+    const size_t n = quick ? 20000 : 500000;
+    for (int budget_us : {0, 1000}) {
+        std::atomic<size_t> done{0};
+        uint64_t start;
+        metrics_snapshot snap;
+        {
+            event_pool ep(2);
+            ep.register_callback("work", [&done]() {
+                uint64_t until = bench_now_ns() + 10000;
+                while (bench_now_ns() < until) {}
+                done.fetch_add(1, std::memory_order_relaxed);
+            });
+            ep.set_deadline("work", std::chrono::microseconds(budget_us),
+                            std::make_shared<handle<void()>>([&done]() {
+                                done.fetch_add(1, std::memory_order_relaxed);
+                            }));
+            start = bench_now_ns();
+            for (size_t i=0; i<n; ++i) {
+                ep.trigger_callback("work");    // far beyond 2 workers at 10us
+            }
+            bench_wait([&done, n]() { return done.load() >= n; }, 120000);
+            snap = ep.metrics();
+        }
+        const auto& s = snap.events[0].second;
+        report.add(bench_result{"expiry"}
+                       .param("budget_us", budget_us)
+                       .param("workers", 2)
+                       .value("triggers", n)
+                       .value("expired", s.expired)
+                       .value("saved_ms", s.saved_ns() / 1e6)
+                       .value("drain_ms", (bench_now_ns() - start) / 1e6));
+    }
+}
+
+static void failing(bench_report& report, const bool quick) {
+    const size_t n = quick ? 20000 : 1000000;
+    for (int percent : {0, 1, 10, 50}) {
+        std::atomic<size_t> done{0};
+        event_pool ep(2);
+        std::atomic<size_t> i{0};
+        ep.register_callback("tick", [&done, &i, percent]() {
+            done.fetch_add(1, std::memory_order_relaxed);
+            if (i.fetch_add(1, std::memory_order_relaxed) % 100 < size_t(percent))
+                throw std::runtime_error("tick");
+        });
+        auto start = bench_clock::now();
+        for (size_t k=0; k<n; ++k) {
+            ep.trigger_callback("tick");
+        }
+        bench_wait([&done, n]() { return done.load() >= n; }, 60000);
+        double sec = std::chrono::duration<double>(bench_clock::now() - start).count();
+        report.add(bench_result{"failing"}
+                       .param("percent", percent)
+                       .param("workers", 2)
+                       .value("triggers_per_sec", done / sec)
+                       .value("failed", Metrics::enabled() ? ep.metrics().events[0].second.failed : 0));
+    }
+}
+
+int main(int argc, char** argv) {
+    bench_args args(argc, argv);
+    bench_report report("benchpool");
+    if (args.run("throughput"))
+        throughput(report, args.quick);
+    if (args.run("staged"))
+        throughput(report, args.quick, true);
+    if (args.run("latency"))
+        latency(report, args.quick);
+    if (args.run("openloop"))
+        openloop(report, args.quick);
+    if (args.run("lookup"))
+        lookup(report, args.quick);
+    if (args.run("alloc"))
+        alloc(report, args.quick);
+    if (args.run("consume"))
+        consume(report, args.quick);
+    if (args.run("record"))
+        record(report, args.quick);
+    if (args.run("expiry"))
+        expiry(report, args.quick);
+    if (args.run("failing"))
+        failing(report, args.quick);
+    if (!args.json.empty() && report.write(args.json)) {
+        fprintf(stderr, "can't write %s\n", args.json.c_str());
+        return 1;
+    }
+    return 0;
+}
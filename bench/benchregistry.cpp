@@ -0,0 +1,83 @@
+//
+// Created by zelin on 2022/7/20.
+//
+// memory per registered event and trigger cost, register_callback() against
+// the compact registry, with one handler taking the entity id.
+//
+// usage: benchregistry [--quick] [--json report.json]
+//   memory   heap bytes per event, from the allocator's in-use count
+//   trigger  producer side ns per trigger, random order over all the events
+#include "bench.h"
+#include "event_pool.h"
+#include "registry.h"
+
+#include <malloc.h>
+#include <random>
+
+static size_t heap_in_use() {
+    return mallinfo2().uordblks;
+}
+
+int main(int argc, char** argv) {
+    bench_args args(argc, argv);
+    bench_report report("benchregistry");
+    const std::vector<size_t> sizes = args.quick ? std::vector<size_t>{10000}
+                                                 : std::vector<size_t>{100000, 1000000};
+    const size_t ops = args.quick ? 20000 : 1000000;
+
+    for (size_t n : sizes) {
+        std::vector<std::string> ids;
+        ids.reserve(n);
+        for (size_t i=0; i<n; ++i) {
+            ids.push_back("entity." + std::to_string(i) + ".state");
+        }
+        std::mt19937 rng(42);
+        std::vector<uint32_t> order(ops);
+        for (auto& o : order) {
+            o = rng() % n;
+        }
+
+        for (int compact=0; compact<2; ++compact) {
+            std::atomic<uint64_t> done{0};
+            event_pool ep(1);
+            size_t before = heap_in_use();
+            if (compact) {
+                auto& reg = ep.compact_registry();
+                int h = reg.add_handler<uint32_t>("state", [&done](uint32_t) {
+                    done.fetch_add(1, std::memory_order_relaxed);
+                });
+                for (size_t i=0; i<n; ++i) {
+                    reg.add(ids[i], h, uint32_t(i));
+                }
+            } else {
+                for (size_t i=0; i<n; ++i) {
+                    ep.register_callback(ids[i], [&done](uint32_t) {
+                        done.fetch_add(1, std::memory_order_relaxed);
+                    }, uint32_t(i));
+                }
+            }
+            double bytes = double(heap_in_use() - before) / n;
+
+            uint64_t start = bench_now_ns();
+            for (auto o : order) {
+                if (compact)
+                    ep.trigger_compact(ids[o]);
+                else
+                    ep.trigger_callback(ids[o]);
+            }
+            double trigger_ns = double(bench_now_ns() - start) / ops;
+            bench_wait([&done, ops]() { return done.load() >= ops; }, 60000);
+
+            report.add(bench_result{compact ? "compact" : "map"}
+                           .param("events", n)
+                           .value("bytes_per_event", bytes)
+                           .value("trigger_ns", trigger_ns));
+        }
+    }
+
+    if (!args.json.empty() && report.write(args.json)) {
+        fprintf(stderr, "can't write %s\n", args.json.c_str());
+        return 1;
+    }
+    return 0;
+}
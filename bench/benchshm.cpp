@@ -0,0 +1,228 @@
+//
+// Created by zelin on 2022/6/2.
+//
+// same host cross process triggers: ShmBus against unix domain sockets.
+// both sides end in an event_pool, the socket side serializes the id and args
+// the way a socket transport would.
+//
+// usage: benchshm [messages] [round trips]
+#include "event_pool.h"
+#include "shm_bus.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+using bench_clock = std::chrono::steady_clock;
+
+static double ns_since(bench_clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(bench_clock::now() - start).count();
+}
+
+static void report(const char* what, const char* transport, std::vector<double>& rtts) {
+    std::sort(rtts.begin(), rtts.end());
+    auto pct = [&rtts](double p) { return rtts[size_t(p * (rtts.size() - 1))] / 2; };
+    printf("%-10s %-5s one way latency ns: p50 %.0f p99 %.0f p99.9 %.0f max %.0f\n",
+           what, transport, pct(0.5), pct(0.99), pct(0.999), rtts.back() / 2);
+}
+
+/// \internal wait for the child to say it is ready
+static void wait_ready(int fd) {
+    char c;
+    if (read(fd, &c, 1) != 1)
+        exit(1);
+}
+
+static void ready(int fd) {
+    char c = 0;
+    if (write(fd, &c, 1) != 1)
+        _exit(1);
+}
+
+// socket message: id, '\0', packed args
+static void send_msg(int fd, const std::string& id, uint64_t v) {
+    char buf[64];
+    std::memcpy(buf, id.c_str(), id.size() + 1);
+    pack_args(buf + id.size() + 1, v);
+    if (send(fd, buf, id.size() + 1 + sizeof(v), 0) < 0)
+        _exit(1);
+}
+
+static bool recv_msg(int fd, std::string& id, uint64_t& v) {
+    char buf[64];
+    ssize_t n = recv(fd, buf, sizeof(buf), 0);
+    if (n <= 0)
+        return false;
+    id.assign(buf);
+    const char* p = buf + id.size() + 1;
+    v = unpack_arg<uint64_t>(p);
+    return true;
+}
+
+static void shm_throughput(const int n) {
+    std::string name = "/benchshm." + std::to_string(getpid());
+    ShmBus bus(name, ShmBus::create, 1 << 14);
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+        return;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::atomic_int count{0};
+        {
+            event_pool ep(1);
+            ep.register_callback("tick", [&count](uint64_t) { ++count; }, uint64_t());
+            ep.attach(bus);
+            ready(pipefd[1]);
+            while (count < n) {
+                usleep(100);
+            }
+        }
+        _exit(0);
+    }
+    wait_ready(pipefd[0]);
+    ShmBus sender(name);
+    auto start = bench_clock::now();
+    for (int i=0; i<n; ++i) {
+        while (sender.publish("tick", uint64_t(i)) != 0) {
+            sched_yield();
+        }
+    }
+    waitpid(pid, nullptr, 0);
+    double ns = ns_since(start);
+    printf("throughput shm   %d triggers in %.1f ms, %.0f /s\n", n, ns / 1e6, n / ns * 1e9);
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+static void uds_throughput(const int n) {
+    int sv[2], pipefd[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 || pipe(pipefd) < 0)
+        return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        std::atomic_int count{0};
+        {
+            event_pool ep(1);
+            ep.register_callback("tick", [&count](uint64_t) { ++count; }, uint64_t());
+            ready(pipefd[1]);
+            std::string id;
+            uint64_t v;
+            for (int i=0; i<n && recv_msg(sv[1], id, v); ++i) {
+                ep.trigger_callback(id, v);
+            }
+            while (count < n) {
+                usleep(100);
+            }
+        }
+        _exit(0);
+    }
+    wait_ready(pipefd[0]);
+    auto start = bench_clock::now();
+    for (int i=0; i<n; ++i) {
+        send_msg(sv[0], "tick", i);
+    }
+    waitpid(pid, nullptr, 0);
+    double ns = ns_since(start);
+    printf("throughput uds   %d triggers in %.1f ms, %.0f /s\n", n, ns / 1e6, n / ns * 1e9);
+    for (int fd : {sv[0], sv[1], pipefd[0], pipefd[1]}) {
+        close(fd);
+    }
+}
+
+static void shm_latency(const int n) {
+    std::string name = "/benchshm." + std::to_string(getpid());
+    std::string reply_name = name + ".reply";
+    ShmBus bus(name, ShmBus::create);
+    ShmBus reply(reply_name, ShmBus::create);
+    int pipefd[2];
+    if (pipe(pipefd) < 0)
+        return;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        ShmBus back(reply_name);
+        std::atomic_int count{0};
+        {
+            event_pool ep(1);
+            ep.register_callback("ping", [&back, &count](uint64_t v) {
+                while (back.publish("pong", v) != 0) {}
+                ++count;
+            }, uint64_t());
+            ep.attach(bus);
+            ready(pipefd[1]);
+            while (count < n) {
+                usleep(100);
+            }
+        }
+        _exit(0);
+    }
+    wait_ready(pipefd[0]);
+    ShmBus sender(name);
+    std::vector<double> rtts;
+    rtts.reserve(n);
+    for (int i=0; i<n; ++i) {
+        auto start = bench_clock::now();
+        sender.publish("ping", uint64_t(i));
+        reply.consume([](const char*, size_t, const void*, size_t) {});
+        rtts.push_back(ns_since(start));
+    }
+    waitpid(pid, nullptr, 0);
+    report("ping-pong", "shm", rtts);
+    close(pipefd[0]);
+    close(pipefd[1]);
+}
+
+static void uds_latency(const int n) {
+    int sv[2], pipefd[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0 || pipe(pipefd) < 0)
+        return;
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = sv[1];
+        {
+            event_pool ep(1);
+            ep.register_callback("ping", [fd](uint64_t v) { send_msg(fd, "pong", v); },
+                                 uint64_t());
+            ready(pipefd[1]);
+            std::string id;
+            uint64_t v;
+            for (int i=0; i<n && recv_msg(fd, id, v); ++i) {
+                ep.trigger_callback(id, v);
+            }
+        }
+        _exit(0);
+    }
+    wait_ready(pipefd[0]);
+    std::vector<double> rtts;
+    rtts.reserve(n);
+    std::string id;
+    uint64_t v;
+    for (int i=0; i<n; ++i) {
+        auto start = bench_clock::now();
+        send_msg(sv[0], "ping", i);
+        recv_msg(sv[0], id, v);
+        rtts.push_back(ns_since(start));
+    }
+    waitpid(pid, nullptr, 0);
+    report("ping-pong", "uds", rtts);
+    for (int fd : {sv[0], sv[1], pipefd[0], pipefd[1]}) {
+        close(fd);
+    }
+}
+
+int main(int argc, char** argv) {
+    int n = argc > 1 ? atoi(argv[1]) : 200000;
+    int rounds = argc > 2 ? atoi(argv[2]) : 20000;
+    shm_throughput(n);
+    uds_throughput(n);
+    shm_latency(rounds);
+    uds_latency(rounds);
+    return 0;
+}
@@ -0,0 +1,151 @@
+//
+// Created by zelin on 2022/7/4.
+//
+// topic matching with 100k concrete topics and 10k patterns.
+//
+// usage: benchtopic [--quick] [--json report.json]
+//   scan     every pattern tested against the topic, the baseline
+//   trie     TopicTrie::match
+//   cached   TopicIndex::match, topics seen before come from the cache
+//   publish  event_pool::publish, producer side. its cache holds 64k topics,
+//            so with 100k topics it keeps refilling
+#include "bench.h"
+#include "event_pool.h"
+#include "topic.h"
+
+#include <random>
+
+/// \internal the baseline: match one pattern against one topic
+static bool glob(const std::vector<std::string>& p, size_t i,
+                 const std::vector<std::string>& t, size_t j) {
+    if (i == p.size())
+        return j == t.size();
+    if (p[i] == "#") {
+        for (size_t k=j; k<=t.size(); ++k) {
+            if (glob(p, i + 1, t, k))
+                return true;
+        }
+        return false;
+    }
+    if (j == t.size())
+        return false;
+    return (p[i] == "*" || p[i] == t[j]) && glob(p, i + 1, t, j + 1);
+}
+
+int main(int argc, char** argv) {
+    bench_args args(argc, argv);
+    bench_report report("benchtopic");
+    const size_t n_patterns = args.quick ? 1000 : 10000;
+    const size_t ops = args.quick ? 20000 : 1000000;
+    const size_t scan_ops = args.quick ? 200 : 2000;
+
+    // region.site.device.metric, 10 x 100 x 10 x 10
+    std::vector<std::string> topics;
+    for (int r=0; r<10; ++r)
+        for (int s=0; s<100; ++s)
+            for (int d=0; d<10; ++d)
+                for (int m=0; m<10; ++m)
+                    topics.push_back("region" + std::to_string(r) + ".site" + std::to_string(s) +
+                                     ".dev" + std::to_string(d) + ".metric" + std::to_string(m));
+
+    std::mt19937 rng(42);
+    auto pick = [&rng](int n) { return std::to_string(rng() % n); };
+    std::vector<std::string> patterns;
+    for (size_t i=0; i<n_patterns; ++i) {
+        switch (i % 10) {
+        case 0: case 1: case 2: case 3:
+            patterns.push_back(topics[rng() % topics.size()]);
+            break;
+        case 4: case 5: case 6:
+            patterns.push_back("region" + pick(10) + ".*.dev" + pick(10) + ".metric" + pick(10));
+            break;
+        case 7: case 8:
+            patterns.push_back("region" + pick(10) + ".site" + pick(100) + ".#");
+            break;
+        default:
+            patterns.push_back("*.site" + pick(100) + ".*.metric" + pick(10));
+        }
+    }
+
+    TopicTrie trie;
+    TopicIndex<size_t> index(topics.size());    // room for every topic
+    std::vector<std::vector<std::string>> split(patterns.size());
+    for (size_t i=0; i<patterns.size(); ++i) {
+        trie.add(patterns[i], i);
+        index.subscribe(patterns[i], i);
+        topic_split(patterns[i], split[i]);
+    }
+    std::vector<uint32_t> order(ops);
+    for (auto& o : order) {
+        o = rng() % topics.size();
+    }
+
+    size_t matched = 0;
+    uint64_t start = bench_now_ns();
+    std::vector<std::string> levels;
+    for (size_t i=0; i<scan_ops; ++i) {
+        topic_split(topics[order[i]], levels);
+        for (auto& p : split) {
+            matched += glob(p, 0, levels, 0);
+        }
+    }
+    double scan_ns = double(bench_now_ns() - start) / scan_ops;
+    report.add(bench_result{"scan"}
+                   .param("topics", topics.size())
+                   .param("patterns", patterns.size())
+                   .value("ns_per_match", scan_ns)
+                   .value("matches_per_topic", double(matched) / scan_ops));
+
+    matched = 0;
+    std::vector<uint64_t> out;
+    start = bench_now_ns();
+    for (auto o : order) {
+        out.clear();
+        trie.match(topics[o], out);
+        matched += out.size();
+    }
+    report.add(bench_result{"trie"}
+                   .param("topics", topics.size())
+                   .param("patterns", patterns.size())
+                   .value("ns_per_match", double(bench_now_ns() - start) / ops)
+                   .value("matches_per_topic", double(matched) / ops));
+
+    for (int pass=0; pass<2; ++pass) {
+        matched = 0;
+        start = bench_now_ns();
+        for (auto o : order) {
+            matched += index.match(topics[o])->size();
+        }
+        report.add(bench_result{pass ? "cached" : "cached_cold"}
+                       .param("topics", topics.size())
+                       .param("patterns", patterns.size())
+                       .value("ns_per_match", double(bench_now_ns() - start) / ops)
+                       .value("matches_per_topic", double(matched) / ops));
+    }
+
+    std::atomic<uint64_t> runs{0};
+    {
+        event_pool ep(2);
+        for (auto& p : patterns) {
+            ep.subscribe(p, [&runs]() { runs.fetch_add(1, std::memory_order_relaxed); });
+        }
+        for (auto o : order) {      // warm the cache
+            ep.publish(topics[o]);
+        }
+        start = bench_now_ns();
+        for (auto o : order) {
+            ep.publish(topics[o]);
+        }
+        report.add(bench_result{"publish"}
+                       .param("topics", topics.size())
+                       .param("patterns", patterns.size())
+                       .param("workers", 2)
+                       .value("ns_per_publish", double(bench_now_ns() - start) / ops));
+    }
+
+    if (!args.json.empty() && report.write(args.json)) {
+        fprintf(stderr, "can't write %s\n", args.json.c_str());
+        return 1;
+    }
+    return 0;
+}
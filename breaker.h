@@ -0,0 +1,147 @@
+//
+// Created by zelin on 2022/7/27.
+//
+
+#ifndef EVENT_MANAGER_BREAKER_H
+#define EVENT_MANAGER_BREAKER_H
+
+#include "handle.h"
+#include "noncopyable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+
+/// what a circuit breaker did to an event
+struct breaker_stats {
+    uint64_t trips = 0;     ///< times it opened
+    uint64_t rejected = 0;  ///< triggers refused while open
+    bool open = false;
+    bool half_open = false; ///< cooled down, one probe decides
+};
+
+/// stops the triggers of an event that keeps failing: after \p failures
+/// handler runs in a row threw, its triggers are refused for \p cooldown.
+/// then it is half open: one trigger goes through as the probe, the others
+/// are still refused until it ran. a success closes it, a failure opens it
+/// again right away. a probe that never reports, e.g. dropped by a rate
+/// limit, is replaced after another cooldown.
+/// the triggers queued before it opened still run, they don't count
+class CircuitBreaker : public noncopyable {
+private:
+    /// \internal tells the breaker how each run went, the exception goes on
+    /// to the pool, see ThreadPool::on_error()
+    class tracked_handle : public handle_base {
+    private:
+        handle_ptr_t inner_;
+        std::shared_ptr<CircuitBreaker> breaker_;
+        const uint64_t trip_;   ///< trips when queued
+    public:
+        tracked_handle(handle_ptr_t inner, std::shared_ptr<CircuitBreaker> breaker) :
+                inner_(std::move(inner)),
+                breaker_(std::move(breaker)),
+                trip_(breaker_->trips_.load(std::memory_order_acquire)) {}
+        void run() override {
+            try {
+                inner_->run();
+            } catch (...) {
+                breaker_->failure(trip_);
+                throw;
+            }
+            breaker_->success(trip_);
+        }
+    };
+
+    const uint32_t failures_;
+    const int64_t cooldown_ns_;
+    std::atomic<uint32_t> in_row_{0};       ///< failed runs in a row
+    std::atomic<int64_t> open_until_{0};    ///< ns, steady clock, 0 while closed
+    std::atomic<int64_t> probe_at_{0};      ///< when the probe went through, 0 for none
+    std::atomic<uint64_t> trips_{0};
+    std::atomic<uint64_t> rejected_{0};
+
+public:
+    CircuitBreaker(const uint32_t failures, const std::chrono::nanoseconds cooldown) :
+            failures_(std::max<uint32_t>(1, failures)),
+            cooldown_ns_(cooldown.count()) {}
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// false while open, the trigger is refused then. once half open, true
+    /// for the one probe
+    bool allow() {
+        const int64_t until = open_until_.load(std::memory_order_acquire);
+        if (!until)
+            return true;
+        const int64_t t = now();
+        if (t >= until) {
+            int64_t at = probe_at_.load(std::memory_order_relaxed);
+            if ((!at || t - at >= cooldown_ns_) &&
+                probe_at_.compare_exchange_strong(at, t, std::memory_order_relaxed))
+                return true;
+        }
+        rejected_.fetch_add(1, std::memory_order_relaxed);
+        return false;
+    }
+
+    /// the handle to queue for a trigger \p breaker allowed
+    static handle_ptr_t wrap(const std::shared_ptr<CircuitBreaker>& breaker, handle_ptr_t h) {
+        return std::make_shared<tracked_handle>(std::move(h), breaker);
+    }
+
+    /// a run queued after \p trip trips went well
+    void success(const uint64_t trip) {
+        if (open_until_.load(std::memory_order_acquire)) {
+            if (trip != trips_.load(std::memory_order_acquire))
+                return;     // queued before it opened
+            in_row_.store(0, std::memory_order_relaxed);
+            probe_at_.store(0, std::memory_order_relaxed);
+            open_until_.store(0, std::memory_order_release);    // the probe closes it
+            return;
+        }
+        if (in_row_.load(std::memory_order_relaxed))
+            in_row_.store(0, std::memory_order_relaxed);
+    }
+
+    /// a run queued after \p trip trips threw
+    void failure(const uint64_t trip) {
+        int64_t until = open_until_.load(std::memory_order_acquire);
+        if (until) {
+            if (trip != trips_.load(std::memory_order_acquire))
+                return;
+            // the probe, open again
+            if (open_until_.compare_exchange_strong(until, now() + cooldown_ns_,
+                                                    std::memory_order_acq_rel))
+                tripped();
+            return;
+        }
+        if (in_row_.fetch_add(1, std::memory_order_relaxed) + 1 < failures_)
+            return;
+        if (open_until_.compare_exchange_strong(until, now() + cooldown_ns_,
+                                                std::memory_order_acq_rel))
+            tripped();
+    }
+
+    breaker_stats stats() const {
+        const int64_t until = open_until_.load(std::memory_order_acquire);
+        const bool cooling = now() < until;
+        return breaker_stats{trips_.load(std::memory_order_relaxed),
+                             rejected_.load(std::memory_order_relaxed),
+                             cooling, until && !cooling};
+    }
+
+private:
+    /// \internal it just opened, the runs queued so far no longer count
+    void tripped() {
+        in_row_.store(0, std::memory_order_relaxed);
+        probe_at_.store(0, std::memory_order_relaxed);
+        trips_.fetch_add(1, std::memory_order_acq_rel);
+    }
+};
+
+#endif //EVENT_MANAGER_BREAKER_H
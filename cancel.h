@@ -0,0 +1,54 @@
+//
+// Created by zelin on 2022/7/15.
+//
+
+#ifndef EVENT_MANAGER_CANCEL_H
+#define EVENT_MANAGER_CANCEL_H
+
+#include <atomic>
+#include <memory>
+
+/// \internal what a cancel_token and its queued task share
+struct cancel_state {
+    enum { pending, started, cancelled };
+    std::atomic<int> v{pending};
+};
+
+/// cancels one queued trigger, see event_pool::trigger_cancellable().
+/// cancelling only marks the task, the worker drops it when it comes to it,
+/// so it still counts in the queue depth until then
+class cancel_token {
+private:
+    std::shared_ptr<cancel_state> state_;
+
+public:
+    cancel_token() = default;
+
+    static cancel_token make() {
+        cancel_token t;
+        t.state_ = std::make_shared<cancel_state>();
+        return t;
+    }
+
+    /// false if no task is attached, e.g. the trigger failed
+    bool valid() const {
+        return state_ != nullptr;
+    }
+
+    /// \return true if the task had not started and now never will
+    bool cancel() {
+        int expected = cancel_state::pending;
+        return state_ && state_->v.compare_exchange_strong(expected, cancel_state::cancelled,
+                                                           std::memory_order_acq_rel);
+    }
+
+    bool cancelled() const {
+        return state_ && state_->v.load(std::memory_order_acquire) == cancel_state::cancelled;
+    }
+
+    const std::shared_ptr<cancel_state>& state() const {
+        return state_;
+    }
+};
+
+#endif //EVENT_MANAGER_CANCEL_H
@@ -12,6 +12,7 @@
 #include <functional>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <thread>
 #include <tuple>
@@ -20,8 +21,17 @@
 
 #include <semaphore.h>
 
+#include "breaker.h"
+#include "cancel.h"
 #include "handle.h"
+#include "ratelimit.h"
+#include "registry.h"
+#include "shm_bus.h"
+#include "taskgraph.h"
+#include "triggerlog.h"
 #include "threadpool.h"
+#include "topic.h"
+#include "trace.h"
 
 /// millisocond timer
 // class timer {
@@ -345,18 +355,71 @@
 //    }
 //}
 
+/// a registered event
+struct event_entry {
+    handle_ptr_t handle;
+    uint32_t metrics = Metrics::new_slot();
+    std::shared_ptr<RateLimiter> limit;     ///< null if not limited
+    std::chrono::nanoseconds budget{0};     ///< to start a trigger in, 0 for no deadline
+    handle_ptr_t on_expire;
+    /// bumped to drop the triggers queued so far, see event_pool::cancel_pending()
+    std::shared_ptr<std::atomic<uint32_t>> generation = std::make_shared<std::atomic<uint32_t>>(0);
+    std::shared_ptr<CircuitBreaker> breaker;    ///< null if it has none
+};
+
 class event_pool {
 private:
     ThreadPool thread_pool_;
     std::mutex lk_;
-    std::unordered_map<std::string, handle_ptr_t> handles_;
+    std::unordered_map<std::string, event_entry> handles_;
+    std::unordered_map<std::string, std::shared_ptr<TokenBucket>> groups_;
+    CompactRegistry compact_;
+    std::atomic<TriggerLog*> log_{nullptr};     ///< recording into, see record()
+    std::vector<std::unique_ptr<TriggerLog>> logs_;     ///< kept until the pool goes
+    TopicIndex<std::shared_ptr<event_entry>> topics_;
+    ShmBus* bus_ = nullptr;
+    std::thread bus_listener_;
+    std::mutex names_lk_;
+    std::unordered_map<uint32_t, std::string> names_;   ///< see name_of()
 public:
     explicit event_pool(const size_t n_threads = 6) :
             thread_pool_(n_threads) {
     }
 
+    /// runs what is already queued, see shutdown()
     ~event_pool() {
-        terminate();
+        shutdown(shutdown_mode::drain);
+    }
+
+    /// dispatch the triggers other processes publish on \p bus with this pool.
+    /// the ids have to be registered here with the same trivially copyable args
+    /// the senders publish, unmatched messages are dropped.
+    /// only one pool may be attached to a bus, \p bus must outlive the pool
+    /// or be detached, see detach(). the ids may still be registered while
+    /// attached, the messages are dispatched under the same lock
+    int attach(ShmBus& bus) {
+        if (bus_)
+            return -1;
+        bus.reopen();
+        bus_ = &bus;
+        bus_listener_ = std::thread([this]() {
+            while (bus_->consume([this](const char* id, size_t id_len,
+                                        const void* payload, size_t len) {
+                dispatch_remote(std::string(id, id_len), payload, len);
+            })) {}
+        });
+        return 0;
+    }
+
+    /// stop receiving from the attached bus. this closes it in this process,
+    /// see ShmBus::close(), attach() reopens it
+    void detach() {
+        if (!bus_)
+            return;
+        bus_->close();
+        if (bus_listener_.joinable())
+            bus_listener_.join();
+        bus_ = nullptr;
     }
 
     // int register_callback(const std::string& id, const handle_ptr_t& hp) {
@@ -369,9 +432,10 @@ public:
 
     int register_callback(const std::string& id,
                           handle_ptr_t hp) {
+        std::lock_guard<std::mutex> lg(lk_);
         if (handles_.find(id) != handles_.end())
             return -1;
-        handles_.emplace(id, hp);
+        handles_.emplace(id, event_entry{hp});
         return 0;
     }
 
@@ -391,61 +455,642 @@ public:
     int register_callback(const std::string& id,
                           type_identity_t<std::function<void(Args...)>> func,
                           Args... args) {
+        std::lock_guard<std::mutex> lg(lk_);
         if (handles_.find(id) != handles_.end()) {
             return -1;
         }
-        auto hp = std::make_shared<handle<void(Args...)> >(func, args...);
-        handles_.template emplace(id, hp);
+        // versioned args, see trigger_and_set()
+        using handle_t = std::conditional_t<sizeof...(Args) == 0, handle<void(Args...)>,
+                                            registered_handle<void(Args...)>>;
+        auto hp = std::make_shared<handle_t>(func, args...);
+        handles_.template emplace(id, event_entry{hp});
         return 0;
     }
 
+    /// the registry for millions of events sharing a few handlers, see
+    /// registry.h. its events are triggered by trigger_compact(), and have no
+    /// limits, deadlines or generations, their metrics are per handler
+    CompactRegistry& compact_registry() {
+        return compact_;
+    }
+
+    int trigger_compact(std::string_view id) {
+        trace_trigger();
+        record_trigger(TriggerLog::compact, id, false);
+        uint32_t slot = Metrics::NO_SLOT;
+        auto h = compact_.make_handle(id, slot);
+        if (!h)
+            return EP_NOT_FOUND;
+        Metrics::on_trigger(slot);
+        return thread_pool_.add_task(h, slot);
+    }
+
+    /// the registered handle of \p id, nullptr if there is none.
+    /// e.g. to make it a TaskGraph node, it then runs with its registered args
+    handle_ptr_t get_handle(const std::string& id) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        return it == handles_.end() ? nullptr : it->second.handle;
+    }
+
+    /// stage the triggers of the calling thread and hand them to the workers
+    /// in batches, see ThreadPool::stage_this_thread()
+    void stage_this_thread(const size_t capacity = 64,
+                           const std::chrono::microseconds max_delay = std::chrono::microseconds(100)) {
+        thread_pool_.stage_this_thread(capacity, max_delay);
+    }
+
+    /// queue what the calling thread staged
+    void flush() {
+        thread_pool_.flush();
+    }
+
+    /// run \p graph \p times times on this pool, see TaskGraph::run()
+    std::future<void> run_graph(TaskGraph& graph, const size_t times = 1) {
+        return graph.run(thread_pool_, times);
+    }
+
+    /// the triggers of \p id still queued are dropped too
     int unregister_callback(const std::string& id) {
         std::lock_guard<std::mutex> lg(lk_);
-        return -!handles_.erase(id);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
+            return -1;
+        it->second.generation->fetch_add(1, std::memory_order_acq_rel);
+        handles_.erase(it);
+        return 0;
+    }
+
+    /// drop the triggers of \p id queued so far, the later ones run as usual.
+    /// O(1): the workers skip them when they come to them
+    /// \return 0, -1 if there is no such id
+    int cancel_pending(const std::string& id) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
+            return -1;
+        it->second.generation->fetch_add(1, std::memory_order_acq_rel);
+        return 0;
     }
 
     int trigger_callback(const std::string& id) {
+        trace_trigger();
+        record_trigger(TriggerLog::trigger, id, false);
         auto it = handles_.find(id);
         if (it == handles_.end()) {
-            return -1;
+            return EP_NOT_FOUND;
         }
-        thread_pool_.add_task(it->second);
-        return 0;
+        if (int ret = admit(it->second))
+            return ret > 0 ? 0 : ret;
+        return enqueue(it->second, it->second.handle);
     }
 
     template<typename ...Args>
     int trigger_callback(const std::string& id, Args... args) {
+        trace_trigger();
+        record_trigger(TriggerLog::trigger, id, true, args...);
         auto it = handles_.find(id);
         if (it == handles_.end()) {
-            return -1;
+            return EP_NOT_FOUND;
         }
-        auto tmp_func = dynamic_cast<handle<void (Args...)>&>(*(it->second))
+        auto tmp_func = dynamic_cast<handle<void (Args...)>&>(*(it->second.handle))
                             .get_func();
-        thread_pool_.template add_task(std::make_shared<handle<void(Args...)>>(tmp_func, args...));
-        return 0;
+        if (int ret = admit(it->second))
+            return ret > 0 ? 0 : ret;
+        return enqueue(it->second, std::make_shared<handle<void(Args...)>>(tmp_func, args...));
     }
     // template<typename Ret, typename ...Args>
     // int trigger_callback<Ret>(const std::string& id, Args... args) {
     // }
     
 
+    /// trigger \p id with \p args and keep them as its args for the triggers
+    /// without any. this run sees exactly \p args, a run already queued or
+    /// running keeps its own, see registered_handle. with a coalescing
+    /// limit, the one queued trigger runs with the args set last.
+    /// a handle registered as a handle_ptr_t has its args set in place, as
+    /// before: this run still gets its own copy, but a plain trigger running
+    /// meanwhile may see them half set
     template<typename ...Args>
     int trigger_and_set(const std::string& id, Args... args) {
+        trace_trigger();
+        record_trigger(TriggerLog::trigger_set, id, true, args...);
         auto it = handles_.find(id);
         if (it == handles_.end()) {
+            return EP_NOT_FOUND;
+        }
+
+        auto plain = dynamic_cast<handle<void (Args...)>*> (it->second.handle.get());
+        if (!plain)
+            return EP_NOT_FOUND;
+        int ret = admit(it->second);
+        if (ret < 0)
+            return ret;
+        handle_ptr_t snapshot;
+        if (auto h = dynamic_cast<registered_handle<void (Args...)>*>(plain)) {
+            snapshot = h->snapshot(args...);
+        } else {
+            plain->set(args...);
+            snapshot = std::make_shared<handle<void(Args...)>>(plain->get_func(), args...);
+        }
+        if (ret > 0)
+            return 0;   // the queued trigger reads the latest args when it runs
+        if (it->second.limit && it->second.limit->coalesces())
+            return enqueue(it->second, it->second.handle);
+        return enqueue(it->second, std::move(snapshot));
+    }
+
+    /// trigger \p id, and set \p token to cancel this one trigger while it is
+    /// queued. \p token is left empty if nothing was queued, i.e. on an error
+    /// or when a rate limit coalesced it into a queued trigger.
+    /// without \p args it runs with the registered ones, like trigger_callback(id)
+    template<typename ...Args>
+    int trigger_cancellable(const std::string& id, cancel_token& token, Args... args) {
+        token = cancel_token();
+        trace_trigger();
+        record_trigger(TriggerLog::trigger, id, sizeof...(Args) > 0, args...);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
+            return EP_NOT_FOUND;
+        handle_ptr_t h = it->second.handle;
+        if constexpr (sizeof...(Args) > 0) {
+            auto p = dynamic_cast<handle<void (Args...)>*>(h.get());
+            if (!p)
+                return EP_NOT_FOUND;
+            h = std::make_shared<handle<void(Args...)>>(p->get_func(), args...);
+        }
+        if (int ret = admit(it->second))
+            return ret > 0 ? 0 : ret;
+        cancel_token t = cancel_token::make();
+        int ret = enqueue(it->second, std::move(h), 0, t.state());
+        if (ret == 0)
+            token = std::move(t);
+        return ret;
+    }
+
+    /// trigger \p id with a deadline: if it has not started running by
+    /// \p deadline it is skipped, and the expiry handler of \p id runs
+    /// instead, see set_deadline(). without \p args it runs with the
+    /// registered ones, like trigger_callback(id)
+    template<typename ...Args>
+    int trigger_with_deadline(const std::string& id, const metrics_clock::time_point deadline,
+                              Args... args) {
+        trace_trigger();
+        record_trigger(TriggerLog::trigger, id, sizeof...(Args) > 0, args...);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
+            return EP_NOT_FOUND;
+        handle_ptr_t h = it->second.handle;
+        if constexpr (sizeof...(Args) > 0) {
+            auto p = dynamic_cast<handle<void (Args...)>*>(h.get());
+            if (!p)
+                return EP_NOT_FOUND;
+            h = std::make_shared<handle<void(Args...)>>(p->get_func(), args...);
+        }
+        if (int ret = admit(it->second))
+            return ret > 0 ? 0 : ret;
+        auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                deadline.time_since_epoch()).count();
+        return enqueue(it->second, std::move(h), std::max<int64_t>(1, ns));
+    }
+
+    /// every trigger of \p id has to start running within \p budget, the late
+    /// ones are skipped and \p on_expire runs instead if given.
+    /// a zero \p budget leaves only the deadlines of trigger_with_deadline().
+    /// set it up before triggering \p id, like register_callback().
+    /// the skipped triggers are counted in event_stats::expired
+    /// \return 0, -1 if there is no such id
+    int set_deadline(const std::string& id, const std::chrono::nanoseconds budget,
+                     handle_ptr_t on_expire = nullptr) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
             return -1;
+        it->second.budget = budget;
+        it->second.on_expire = std::move(on_expire);
+        return 0;
+    }
+
+    /// create or replace the token bucket shared by the events of \p group,
+    /// events already limited keep the bucket they joined
+    /// \return 0, -1 if \p rate or \p burst is invalid, see TokenBucket::valid()
+    int limit_group(const std::string& group, const double rate, const double burst) {
+        if (!TokenBucket::valid(rate, burst))
+            return -1;
+        auto bucket = std::make_shared<TokenBucket>(rate, burst);
+        std::lock_guard<std::mutex> lg(lk_);
+        groups_[group] = std::move(bucket);
+        return 0;
+    }
+
+    /// limit the triggers of \p id, counted against \p group too if given.
+    /// set it up before triggering \p id, like register_callback().
+    /// \return 0, -1 if there is no such id or group, or the limit is invalid
+    int limit_event(const std::string& id, const rate_limit& limit,
+                    const std::string& group = "") {
+        if (!TokenBucket::valid(limit.rate, limit.burst))
+            return -1;
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
+            return -1;
+        std::shared_ptr<TokenBucket> g;
+        if (!group.empty()) {
+            auto git = groups_.find(group);
+            if (git == groups_.end())
+                return -1;
+            g = git->second;
         }
+        it->second.limit = std::make_shared<RateLimiter>(limit, g);
+        return 0;
+    }
 
-        auto h = dynamic_cast<handle<void (Args...)>*> (it->second.get());
-        if (!h)
+    int unlimit_event(const std::string& id) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
             return -1;
-        h->set(args...);
-        thread_pool_.add_task(it->second);
+        it->second.limit.reset();
         return 0;
     }
 
+    /// refuse the triggers of \p id with EP_OPEN for \p cooldown once
+    /// \p failures runs in a row threw, see CircuitBreaker. zero \p failures
+    /// removes it. set it up before triggering \p id, like limit_event()
+    /// \return 0, -1 if there is no such id
+    int set_breaker(const std::string& id, const uint32_t failures,
+                    const std::chrono::milliseconds cooldown) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end())
+            return -1;
+        if (failures)
+            it->second.breaker = std::make_shared<CircuitBreaker>(failures, cooldown);
+        else
+            it->second.breaker.reset();
+        return 0;
+    }
+
+    /// what the breaker of \p id did so far, all zero if it has none
+    breaker_stats circuit_stats(const std::string& id) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end() || !it->second.breaker)
+            return breaker_stats{};
+        return it->second.breaker->stats();
+    }
+
+    /// \p on_error(id, exception) for every handler run that threw, on the
+    /// worker it ran on. the run is counted in event_stats::failed either
+    /// way and the worker goes on, see ThreadPool::on_error()
+    void on_error(std::function<void(const std::string&, std::exception_ptr)> on_error) {
+        std::function<void(uint32_t, std::exception_ptr)> f;
+        if (on_error) {
+            f = [this, on_error](const uint32_t slot, std::exception_ptr err) {
+                on_error(name_of(slot), std::move(err));
+            };
+        }
+        thread_pool_.on_error(std::move(f));
+    }
+
+    /// what the limit of \p id did so far, all zero if it has none
+    limit_stats rate_limit_stats(const std::string& id) {
+        std::lock_guard<std::mutex> lg(lk_);
+        auto it = handles_.find(id);
+        if (it == handles_.end() || !it->second.limit)
+            return limit_stats{};
+        return it->second.limit->stats();
+    }
+
+    /// subscribe \p func to every topic matching \p pattern, see topic.h.
+    /// \return the subscription id, -1 if \p pattern is not valid
+    template<typename ...Args>
+    int64_t subscribe(const std::string& pattern,
+                      type_identity_t<std::function<void(Args...)>> func,
+                      Args... args) {
+        auto hp = std::make_shared<handle<void(Args...)> >(func, args...);
+        return topics_.subscribe(pattern, std::make_shared<event_entry>(event_entry{hp}));
+    }
+
+    int unsubscribe(const int64_t subscription) {
+        return topics_.unsubscribe(subscription);
+    }
+
+    /// trigger every subscriber whose pattern matches the concrete \p topic,
+    /// with its subscribed args.
+    /// \return how many were triggered, or EP_SHUTDOWN
+    int publish(const std::string& topic) {
+        trace_trigger();
+        record_trigger(TriggerLog::publish, topic, false);
+        auto subs = topics_.match(topic);
+        int n = 0;
+        for (auto& e : *subs) {
+            Metrics::on_trigger(e->metrics);
+            int ret = enqueue(*e, e->handle);
+            if (ret < 0)
+                return ret;
+            ++n;
+        }
+        return n;
+    }
+
+    /// publish() with \p args, the subscribers with other arg types are skipped
+    template<typename ...Args>
+    int publish(const std::string& topic, Args... args) {
+        trace_trigger();
+        record_trigger(TriggerLog::publish, topic, true, args...);
+        auto subs = topics_.match(topic);
+        int n = 0;
+        for (auto& e : *subs) {
+            auto h = dynamic_cast<handle<void(Args...)>*>(e->handle.get());
+            if (!h)
+                continue;
+            Metrics::on_trigger(e->metrics);
+            int ret = enqueue(*e, std::make_shared<handle<void(Args...)>>(h->get_func(), args...));
+            if (ret < 0)
+                return ret;
+            ++n;
+        }
+        return n;
+    }
+
+    /// record every trigger from now on into the file \p path, see
+    /// triggerlog.h. the triggers with args that are not trivially copyable
+    /// are left out. the log is full after \p capacity bytes, about 32 plus
+    /// the id and the args per trigger. it is finished when the pool goes.
+    /// \return 0, -1 if \p path can't be created or a recording is on already
+    int record(const std::string& path, const size_t capacity = size_t(64) << 20) {
+        std::lock_guard<std::mutex> lg(lk_);
+        if (log_.load())
+            return -1;
+        try {
+            logs_.emplace_back(new TriggerLog(path, capacity));
+        } catch (const std::exception&) {
+            return -1;
+        }
+        log_.store(logs_.back().get(), std::memory_order_release);
+        return 0;
+    }
+
+    /// stop recording, the triggers on the way may still be written
+    /// \return the triggers that did not fit in or were left out
+    uint64_t stop_recording() {
+        std::lock_guard<std::mutex> lg(lk_);
+        TriggerLog* log = log_.exchange(nullptr);
+        return log ? log->dropped() : 0;
+    }
+
+    /// trigger again what record() wrote to \p path, at \p speed times the
+    /// recorded pace, e.g. 2 for twice as fast, or as fast as it goes if
+    /// \p speed is 0. the ids have to be registered with the same arg types.
+    /// trigger_and_set() comes back as a trigger with those args, and the
+    /// deadlines and cancel tokens of the original triggers are not kept
+    /// \return the number of triggers replayed, -1 if \p path can't be read
+    int64_t replay(const std::string& path, const double speed = 1) {
+        std::unique_ptr<TriggerLog> log;
+        try {
+            log.reset(new TriggerLog(path));
+        } catch (const std::exception&) {
+            return -1;
+        }
+        const uint64_t start = metrics_now_ns();
+        return static_cast<int64_t>(log->for_each([this, speed, start](const TriggerLog::record_t& r) {
+            if (speed > 0) {
+                const auto due = start + static_cast<uint64_t>(r.time_ns / speed);
+                uint64_t now = metrics_now_ns();
+                if (due > now + 100000)
+                    std::this_thread::sleep_for(std::chrono::nanoseconds(due - now - 50000));
+                while (metrics_now_ns() < due) {}
+            }
+            std::string id(r.id, r.id_len);
+            switch (r.kind) {
+            case TriggerLog::trigger:
+            case TriggerLog::trigger_set:
+                if (r.has_args)
+                    dispatch_remote(id, r.payload, r.payload_len);
+                else
+                    trigger_callback(id);
+                break;
+            case TriggerLog::publish:
+                if (r.has_args)
+                    publish_packed(id, r.payload, r.payload_len);
+                else
+                    publish(id);
+                break;
+            case TriggerLog::compact:
+                trigger_compact(id);
+                break;
+            }
+        }));
+    }
+
+    /// counters and latency histograms of every registered event and
+    /// subscription ("sub:<pattern>"), and the state of every worker.
+    /// all zero if built with EVENT_MANAGER_NO_METRICS
+    metrics_snapshot metrics() {
+        metrics_snapshot snap;
+        {
+            std::lock_guard<std::mutex> lg(lk_);
+            snap.events.reserve(handles_.size());
+            for (auto& h : handles_) {
+                snap.events.emplace_back(h.first, Metrics::read(h.second.metrics));
+            }
+        }
+        topics_.for_each([&snap](const std::string& pattern, const std::shared_ptr<event_entry>& e) {
+            snap.events.emplace_back("sub:" + pattern, Metrics::read(e->metrics));
+        });
+        compact_.for_each_handler([&snap](const std::string& name, const uint32_t slot) {
+            snap.events.emplace_back("compact:" + name, Metrics::read(slot));
+        });
+        snap.workers = thread_pool_.stats();
+        return snap;
+    }
+
+    /// write what Tracer recorded as chrome trace json, see trace.h
+    /// \return 0 on success, -1 if \p path can't be written
+    int dump_trace(const std::string& path) {
+        return Tracer::dump(path, slot_names());
+    }
+
+    /// measure the thread cpu time of every handler run, next to its wall
+    /// time, see ThreadPool::measure_cpu() and event_stats::cpu_time
+    void measure_cpu(const bool on) {
+        thread_pool_.measure_cpu(on);
+    }
+
+    /// watch for handlers running longer than \p threshold, each such run
+    /// counts in event_stats::slow and \p on_slow(id, running so far) is
+    /// called once for it, from the watchdog thread. with \p move_queue the
+    /// triggers queued behind it go to the other workers.
+    /// see ThreadPool::watch(), a zero \p threshold stops watching
+    void watch_slow(const std::chrono::microseconds threshold,
+                    std::function<void(const std::string&, std::chrono::nanoseconds)> on_slow = nullptr,
+                    const bool move_queue = true) {
+        std::function<void(size_t, uint32_t, uint64_t)> f;
+        if (on_slow) {
+            f = [this, on_slow](size_t, const uint32_t slot, const uint64_t ns) {
+                on_slow(name_of(slot), std::chrono::nanoseconds(ns));
+            };
+        }
+        thread_pool_.watch(threshold, std::move(f), move_queue);
+    }
+
+    /// stop the pool: from now on the triggers return EP_SHUTDOWN.
+    /// \p mode tells what happens to the tasks already queued, see
+    /// ThreadPool::shutdown(). the attached bus, if any, is closed first.
+    /// \return the number of queued triggers that never ran
+    size_t shutdown(const shutdown_mode mode,
+                    const std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        detach();
+        size_t dropped = thread_pool_.shutdown(mode, timeout);
+        if (Tracer::on()) {
+            auto path = Tracer::terminate_path();
+            if (!path.empty())
+                dump_trace(path);
+        }
+        return dropped;
+    }
+
+    /// stop now, dropping the queued triggers.
+    /// there is no way to rerun the pool after this
     void terminate() {
-        thread_pool_.terminate();
+        shutdown(shutdown_mode::immediate);
+    }
+
+private:
+    /// \internal metrics slot -> event id, as metrics() names them
+    std::unordered_map<uint32_t, std::string> slot_names() {
+        std::unordered_map<uint32_t, std::string> names;
+        {
+            std::lock_guard<std::mutex> lg(lk_);
+            for (auto& h : handles_) {
+                names.emplace(h.second.metrics, h.first);
+            }
+        }
+        topics_.for_each([&names](const std::string& pattern, const std::shared_ptr<event_entry>& e) {
+            names.emplace(e->metrics, "sub:" + pattern);
+        });
+        compact_.for_each_handler([&names](const std::string& name, const uint32_t slot) {
+            names.emplace(slot, "compact:" + name);
+        });
+        return names;
+    }
+
+    /// \internal the id of metrics slot \p slot, empty if it has none.
+    /// cached, rebuilt when a slot is not in it yet
+    std::string name_of(const uint32_t slot) {
+        if (slot == Metrics::NO_SLOT)
+            return std::string();
+        std::lock_guard<std::mutex> lg(names_lk_);
+        auto it = names_.find(slot);
+        if (it == names_.end()) {
+            names_ = slot_names();
+            it = names_.find(slot);
+            if (it == names_.end())
+                return std::string();
+        }
+        return it->second;
+    }
+
+    /// \internal the handle isn't known yet, enqueue tells which one it was
+    static void trace_trigger() {
+        Tracer::record_event(Tracer::trigger, 0, Metrics::NO_SLOT);
+    }
+
+    /// \internal count the trigger and apply the circuit breaker and rate
+    /// limit of \p e.
+    /// \return 0 to go on, EP_OPEN, EP_REJECTED, or 1 if merged into a queued trigger
+    static int admit(const event_entry& e) {
+        Metrics::on_trigger(e.metrics);
+        if (e.breaker && !e.breaker->allow()) {
+            Metrics::on_drop(e.metrics);
+            return EP_OPEN;
+        }
+        if (!e.limit)
+            return 0;
+        switch (e.limit->check()) {
+        case RateLimiter::admit:
+            return 0;
+        case RateLimiter::coalesced:
+            return 1;
+        default:
+            Metrics::on_drop(e.metrics);
+            return EP_REJECTED;
+        }
+    }
+
+    /// \internal queue an admitted trigger of \p e
+    int enqueue(const event_entry& e, handle_ptr_t h, uint64_t deadline_ns = 0,
+                std::shared_ptr<cancel_state> cancel = nullptr) {
+        if (e.breaker)
+            h = CircuitBreaker::wrap(e.breaker, std::move(h));
+        if (e.limit)
+            h = e.limit->wrap(std::move(h));
+        if (!deadline_ns && e.budget.count() > 0)
+            deadline_ns = metrics_now_ns() + e.budget.count();
+        task_t task{std::move(h), e.metrics};
+        task.deadline_ns = deadline_ns;
+        task.on_expire = e.on_expire;
+        task.cancel = std::move(cancel);
+        task.generation = e.generation;
+        task.generation_seen = e.generation->load(std::memory_order_acquire);
+        return thread_pool_.submit(std::move(task));
+    }
+
+    /// \internal append a trigger to the log if recording
+    template<typename ...Args>
+    void record_trigger(const TriggerLog::kind_t kind, std::string_view id, const bool has_args,
+                        const Args&... args) {
+        TriggerLog* log = log_.load(std::memory_order_acquire);
+        if (!log)
+            return;
+        if constexpr (is_trivially_packable<Args...>::value)
+            log->append(kind, id, has_args, args...);
+        else
+            log->drop();
+    }
+
+    /// \internal publish() with packed args, for replay()
+    int publish_packed(const std::string& topic, const void* payload, const size_t len) {
+        trace_trigger();
+        if (TriggerLog* log = log_.load(std::memory_order_acquire))
+            log->append_bytes(TriggerLog::publish, topic, payload, len);
+        auto subs = topics_.match(topic);
+        int n = 0;
+        for (auto& e : *subs) {
+            auto h = e->handle->from_bytes(payload, len);
+            if (!h)
+                continue;
+            Metrics::on_trigger(e->metrics);
+            int ret = enqueue(*e, std::move(h));
+            if (ret < 0)
+                return ret;
+            ++n;
+        }
+        return n;
+    }
+
+    /// \internal unpack a message from the bus and add it as a task
+    int dispatch_remote(const std::string& id, const void* payload, size_t len) {
+        handle_ptr_t hp;
+        // copied, never default constructed: that would take a metrics slot
+        std::optional<event_entry> e;
+        {
+            trace_trigger();
+            if (TriggerLog* log = log_.load(std::memory_order_acquire))
+                log->append_bytes(TriggerLog::trigger, id, payload, len);
+            std::lock_guard<std::mutex> lg(lk_);
+            auto it = handles_.find(id);
+            if (it == handles_.end())
+                return -1;
+            hp = it->second.handle->from_bytes(payload, len);
+            e.emplace(it->second);
+        }
+        if (!hp)
+            return -1;
+        if (int ret = admit(*e))
+            return ret > 0 ? 0 : ret;
+        return enqueue(*e, hp);
     }
 };
 
@@ -5,7 +5,11 @@
 #ifndef EVENT_MANAGER_HANDLE_H
 #define EVENT_MANAGER_HANDLE_H
 
+#include <array>
+#include <atomic>
+#include <cstring>
 #include <future>
+#include <memory>
 #include <type_traits>
 
 template <typename T>
@@ -17,6 +21,9 @@ template <typename T>
 using type_identity_t =  typename type_identity<T>::type;
 
 
+class handle_base;
+using handle_ptr_t = std::shared_ptr<handle_base>;
+
 class handle_base {
 private:
     std::launch strategy = std::launch::deferred;
@@ -24,10 +31,43 @@ public:
     virtual ~handle_base() = default;
     virtual void run() = 0;
 
-
+    /// create a new handle sharing this function, with the args unpacked from
+    /// \p data (written by pack_args()). returns nullptr if the args are not
+    /// trivially copyable or \p size does not match
+    virtual handle_ptr_t from_bytes(const void* data, size_t size) const {
+        return nullptr;
+    }
 };
 
-using handle_ptr_t = std::shared_ptr<handle_base>;
+template <typename ...Args>
+struct is_trivially_packable :
+        std::conjunction<std::is_trivially_copyable<std::decay_t<Args>>...> {};
+
+/// bytes needed by pack_args() for \tparam Args
+template <typename ...Args>
+constexpr size_t packed_size() {
+    return (size_t(0) + ... + sizeof(std::decay_t<Args>));
+}
+
+/// write the args back to back into \p buf, which must hold packed_size<Args...>()
+/// bytes. only for trivially copyable args, the layout is the same in all
+/// processes built from the same source
+template <typename ...Args>
+void pack_args(void* buf, const Args&... args) {
+    static_assert(is_trivially_packable<Args...>::value,
+                  "only trivially copyable args can be packed");
+    auto p = static_cast<char*>(buf);
+    ((std::memcpy(p, &args, sizeof(args)), p += sizeof(args)), ...);
+}
+
+/// \internal read back one arg written by pack_args()
+template <typename T>
+T unpack_arg(const char*& p) {
+    T t;
+    std::memcpy(&t, p, sizeof(T));
+    p += sizeof(T);
+    return t;
+}
 #if __cplusplus < 201401
 /// \todo
 #elif __cplusplus < 201703  // c++ 14
@@ -68,6 +108,12 @@ public:
     void run() {
         function_();
     }
+
+    handle_ptr_t from_bytes(const void* data, size_t size) const override {
+        if (size != 0)
+            return nullptr;
+        return std::make_shared<handle<Ret()>>(*this);
+    }
     
     /// copy
     handle(const handle<Ret()>& lhs) :
@@ -135,11 +181,24 @@ public:
 
 
 
-    /// not thread safe, may need to add lock job while using it,
-    /// depending on the args and function
+    /// not thread safe against set(), registered_handle is. the function
+    /// itself may still need a lock, depending on what it touches
     void run() override {
         call(function_, args_);
     }
+
+    handle_ptr_t from_bytes(const void* data, size_t size) const override {
+        if constexpr (is_trivially_packable<Args...>::value) {
+            if (size != packed_size<Args...>())
+                return nullptr;
+            auto p = static_cast<const char*>(data);
+            // braced init keeps the unpacking order left to right
+            return std::shared_ptr<handle>(new handle{function_,
+                                                      unpack_arg<std::decay_t<Args>>(p)...});
+        } else {
+            return nullptr;
+        }
+    }
     /// function with return
     // Ret run() {
     //     return call(function_, args_);
@@ -165,6 +224,156 @@ public:
 
 };
 
+template <typename ...T>
+class registered_handle { };
+
+/// the handle of a registered event, see event_pool::trigger_and_set().
+/// set() publishes a new version of the args instead of writing them in
+/// place, so a run always reads one whole version, and snapshot() hands out
+/// a handle bound to exactly the args it was given, whatever is set later.
+///
+/// the versions are handles reused once no task holds them and they are not
+/// the current one, in chunks of CHUNK. snapshot() tries at most
+/// PROBE_CHUNKS chunks, from the one it last found a free version in and
+/// going round the list, and adds a chunk when those are all in use. so a
+/// call costs the same whatever the backlog, in the steady state neither
+/// allocates, and the chunks grow to about the most triggers queued at once.
+/// the current version is published as a pointer to its entry, a run pins
+/// it like a hazard pointer: no lock on either side
+template <typename Ret, typename ...Args>
+class registered_handle<Ret(Args...)> : public handle<Ret(Args...)> {
+private:
+    using base = handle<Ret(Args...)>;
+    using version_ptr = std::shared_ptr<base>;
+    static const size_t CHUNK = 16;
+    static const size_t PROBE_CHUNKS = 2;
+
+    struct chunk {
+        std::array<version_ptr, CHUNK> versions;
+        /// a writer owns versions[i] while it holds claimed[i]
+        std::array<std::atomic<bool>, CHUNK> claimed{};
+        std::atomic<chunk*> next{nullptr};
+    };
+
+    std::atomic<chunk*> chunks_{nullptr};       ///< allocated on the first set()
+    std::atomic<chunk*> tail_{nullptr};         ///< the last chunk, or close behind it
+    std::atomic<chunk*> hint_{nullptr};         ///< where snapshot() looks first
+    std::atomic<size_t> next_{0};
+    /// the entry of the latest version, null until set()
+    std::atomic<const version_ptr*> current_{nullptr};
+
+public:
+    template<typename Functor>
+    registered_handle(Functor func, Args... args) :
+            base(func, args...) {}
+
+    ~registered_handle() override {
+        for (chunk* c = chunks_.load(); c;) {
+            chunk* next = c->next.load();
+            delete c;
+            c = next;
+        }
+    }
+
+    /// with the latest version of the args
+    void run() override {
+        const version_ptr* e = current_.load(std::memory_order_seq_cst);
+        if (!e) {
+            base::run();    // the args it was registered with, never written
+            return;
+        }
+        while (true) {
+            version_ptr v = *e;     // the entry itself is never reassigned
+            // still current once pinned, so no writer can take it now
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            const version_ptr* now = current_.load(std::memory_order_seq_cst);
+            if (now == e) {
+                v->run();
+                return;
+            }
+            e = now;
+        }
+    }
+
+    /// the args of the later runs, safe while it runs
+    void set(Args... args) {
+        snapshot(args...);
+    }
+
+    /// set() \p args, \return a handle running with exactly these
+    handle_ptr_t snapshot(Args... args) {
+        // the triggers mostly run in order, so past the chunk handed out from
+        // last come the versions handed out the longest ago, likely done
+        const size_t start = next_.fetch_add(1, std::memory_order_relaxed);
+        const version_ptr* e = nullptr;
+        version_ptr v;
+        chunk* c = hint_.load(std::memory_order_acquire);
+        for (size_t n=0; c && n<PROBE_CHUNKS; ++n) {
+            for (size_t k=0; k<CHUNK && !e; ++k) {
+                e = claim(*c, (start + k) % CHUNK, v, args...);
+            }
+            if (e)
+                break;
+            chunk* next = c->next.load(std::memory_order_acquire);
+            c = next ? next : chunks_.load(std::memory_order_acquire);
+        }
+        if (!e) {
+            // all in use, add a chunk at the end
+            c = append();
+            for (size_t i=0; i<CHUNK && !e; ++i) {
+                e = claim(*c, i, v, args...);
+            }
+        }
+        if (hint_.load(std::memory_order_relaxed) != c)
+            hint_.store(c, std::memory_order_release);
+        current_.store(e, std::memory_order_seq_cst);
+        return v;
+    }
+
+private:
+    /// \internal link a new chunk at the end of the list, \return it
+    chunk* append() {
+        auto c = new chunk;
+        chunk* t = tail_.load(std::memory_order_acquire);
+        while (true) {
+            std::atomic<chunk*>& at = t ? t->next : chunks_;
+            chunk* expected = nullptr;
+            if (at.compare_exchange_strong(expected, c, std::memory_order_acq_rel))
+                break;
+            t = expected;   // another writer added one, go past it
+        }
+        tail_.store(c, std::memory_order_release);
+        return c;
+    }
+
+    /// \internal set version \p i of \p c to \p args and pin it in \p out.
+    /// \return its entry, null if it is in use
+    const version_ptr* claim(chunk& c, const size_t i, version_ptr& out, const Args&... args) {
+        if (c.claimed[i].exchange(true, std::memory_order_acquire))
+            return nullptr;
+        version_ptr& v = c.versions[i];
+        if (!v) {
+            v = std::make_shared<base>(static_cast<const base&>(*this));
+        } else {
+            // not current, then not pinned: a run pins before it checks
+            // current, this checks current before the count
+            bool busy = current_.load(std::memory_order_seq_cst) == &v;
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (busy || v.use_count() != 1) {
+                c.claimed[i].store(false, std::memory_order_release);
+                return nullptr;
+            }
+            // the count dropped to 1 with a release, this pairs with it: the
+            // last run of this version is over
+            std::atomic_thread_fence(std::memory_order_acquire);
+        }
+        v->set(args...);
+        out = v;    // pinned by the caller until it is current or queued
+        c.claimed[i].store(false, std::memory_order_release);
+        return &v;
+    }
+};
+
 // template <typename Func, typename ...Args>
 // inline handle_ptr_t create_handle_ptr(Func func, Args... args) {
 //     using result_type = std::result_of_t<Func>;
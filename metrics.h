@@ -0,0 +1,432 @@
+//
+// Created by zelin on 2022/6/9.
+//
+
+#ifndef EVENT_MANAGER_METRICS_H
+#define EVENT_MANAGER_METRICS_H
+
+/// build with -DEVENT_MANAGER_NO_METRICS to compile all the recording out,
+/// the snapshots are then all zero
+#ifndef EVENT_MANAGER_NO_METRICS
+#define EVENT_MANAGER_METRICS 1
+#else
+#define EVENT_MANAGER_METRICS 0
+#endif
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using metrics_clock = std::chrono::steady_clock;
+
+inline uint64_t metrics_now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            metrics_clock::now().time_since_epoch()).count();
+}
+
+/// \p s as the inside of a json string, for the metrics and the trace dumps
+inline std::string json_escape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+/// log-bucket histogram: each power of 2 is split into 2^SUB_BITS linear
+/// buckets, so a bucket is within 25% of the values in it.
+/// values from 2^32 on (about 4.3s in ns) all land in the last bucket
+struct histogram_snapshot {
+    static const int SUB_BITS = 2;
+    static const int BUCKETS  = 32 << SUB_BITS;
+
+    std::array<uint64_t, BUCKETS> buckets{};
+    uint64_t count = 0;
+    uint64_t sum = 0;
+
+    static int index(const uint64_t v) {
+        if (v < (1u << SUB_BITS))
+            return static_cast<int>(v);
+        int msb = 63 - __builtin_clzll(v);
+        if (msb >= 32)
+            return BUCKETS - 1;
+        int sub = static_cast<int>(v >> (msb - SUB_BITS)) & ((1 << SUB_BITS) - 1);
+        return ((msb - SUB_BITS + 1) << SUB_BITS) + sub;
+    }
+
+    /// the smallest value landing in bucket \p i
+    static uint64_t lower_bound(const int i) {
+        if (i < (1 << SUB_BITS))
+            return i;
+        int msb = (i >> SUB_BITS) + SUB_BITS - 1;
+        return (uint64_t(1) << msb) + (uint64_t(i & ((1 << SUB_BITS) - 1)) << (msb - SUB_BITS));
+    }
+
+    double mean() const {
+        return count ? double(sum) / count : 0;
+    }
+
+    /// \p p in [0, 1], the lower bound of the bucket holding that rank
+    uint64_t percentile(const double p) const {
+        if (!count)
+            return 0;
+        auto rank = static_cast<uint64_t>(p * (count - 1)) + 1;
+        uint64_t seen = 0;
+        for (int i=0; i<BUCKETS; ++i) {
+            seen += buckets[i];
+            if (seen >= rank)
+                return lower_bound(i);
+        }
+        return lower_bound(BUCKETS - 1);
+    }
+
+    void merge(const histogram_snapshot& other) {
+        for (int i=0; i<BUCKETS; ++i) {
+            buckets[i] += other.buckets[i];
+        }
+        count += other.count;
+        sum += other.sum;
+    }
+};
+
+struct event_stats {
+    uint64_t triggers = 0;
+    uint64_t drops = 0;     ///< triggers refused by the pool
+    uint64_t runs = 0;
+    uint64_t expired = 0;   ///< queued triggers skipped past their deadline
+    uint64_t cancelled = 0; ///< queued triggers dropped by cancellation
+    uint64_t slow = 0;      ///< runs the watchdog caught over its threshold
+    uint64_t failed = 0;    ///< runs the handler threw out of, counted in runs too
+    histogram_snapshot queue_wait;  ///< ns from add_task to run
+    histogram_snapshot run_time;    ///< ns inside the handler
+    histogram_snapshot cpu_time;    ///< cpu ns of the handler, if measured
+
+    /// the handler time the expired triggers would have taken, estimated
+    /// from the mean run time
+    double saved_ns() const {
+        return expired * run_time.mean();
+    }
+
+    void merge(const event_stats& other) {
+        triggers += other.triggers;
+        drops += other.drops;
+        runs += other.runs;
+        expired += other.expired;
+        cancelled += other.cancelled;
+        slow += other.slow;
+        failed += other.failed;
+        queue_wait.merge(other.queue_wait);
+        run_time.merge(other.run_time);
+        cpu_time.merge(other.cpu_time);
+    }
+};
+
+struct worker_stats {
+    uint64_t tasks = 0;
+    uint64_t busy_ns = 0;
+    uint64_t expired = 0;   ///< tasks skipped past their deadline
+    uint64_t moved = 0;     ///< queued tasks the watchdog moved off it
+    uint64_t failed = 0;    ///< tasks that threw
+    size_t queue_depth = 0;
+};
+
+struct metrics_snapshot {
+    std::vector<std::pair<std::string, event_stats>> events;
+    std::vector<worker_stats> workers;
+
+    /// one json object, times in ns
+    std::string to_json() const {
+        std::string out = "{\"events\":{";
+        char buf[1024];
+        for (size_t i=0; i<events.size(); ++i) {
+            const auto& e = events[i].second;
+            snprintf(buf, sizeof(buf),
+                     "\"triggers\":%llu,\"drops\":%llu,\"runs\":%llu,"
+                     "\"expired\":%llu,\"saved_ns\":%.0f,\"cancelled\":%llu,\"slow\":%llu,"
+                     "\"failed\":%llu,"
+                     "\"queue_wait\":{\"mean\":%.0f,\"p50\":%llu,\"p99\":%llu,\"max\":%llu},"
+                     "\"run_time\":{\"mean\":%.0f,\"p50\":%llu,\"p99\":%llu,\"max\":%llu},"
+                     "\"cpu_time\":{\"mean\":%.0f,\"p50\":%llu,\"p99\":%llu,\"max\":%llu}}",
+                     (unsigned long long) e.triggers, (unsigned long long) e.drops,
+                     (unsigned long long) e.runs,
+                     (unsigned long long) e.expired, e.saved_ns(),
+                     (unsigned long long) e.cancelled, (unsigned long long) e.slow,
+                     (unsigned long long) e.failed,
+                     e.queue_wait.mean(), (unsigned long long) e.queue_wait.percentile(0.5),
+                     (unsigned long long) e.queue_wait.percentile(0.99),
+                     (unsigned long long) e.queue_wait.percentile(1),
+                     e.run_time.mean(), (unsigned long long) e.run_time.percentile(0.5),
+                     (unsigned long long) e.run_time.percentile(0.99),
+                     (unsigned long long) e.run_time.percentile(1),
+                     e.cpu_time.mean(), (unsigned long long) e.cpu_time.percentile(0.5),
+                     (unsigned long long) e.cpu_time.percentile(0.99),
+                     (unsigned long long) e.cpu_time.percentile(1));
+            out += (i ? ",\"" : "\"") + json_escape(events[i].first) + "\":{" + buf;
+        }
+        out += "},\"workers\":[";
+        for (size_t i=0; i<workers.size(); ++i) {
+            snprintf(buf, sizeof(buf),
+                     "%s{\"tasks\":%llu,\"busy_ns\":%llu,\"expired\":%llu,\"moved\":%llu,"
+                     "\"failed\":%llu,\"queue_depth\":%zu}",
+                     i ? "," : "", (unsigned long long) workers[i].tasks,
+                     (unsigned long long) workers[i].busy_ns,
+                     (unsigned long long) workers[i].expired,
+                     (unsigned long long) workers[i].moved,
+                     (unsigned long long) workers[i].failed, workers[i].queue_depth);
+            out += buf;
+        }
+        return out + "]}";
+    }
+};
+
+/// per event counters, kept per thread so recording never shares a cache line
+/// with another thread. each thread only writes its own shard (plain relaxed
+/// load + store, no locked instruction), Metrics::read() sums all the shards.
+///
+/// events are numbered by Metrics::new_slot(), a slot is never reused.
+class Metrics {
+public:
+    static const uint32_t NO_SLOT = UINT32_MAX;
+
+private:
+    struct counter {
+        std::atomic<uint64_t> v{0};
+        void add(const uint64_t n = 1) { v.store(v.load(std::memory_order_relaxed) + n,
+                                                 std::memory_order_relaxed); }
+        uint64_t get() const { return v.load(std::memory_order_relaxed); }
+    };
+
+    struct histogram {
+        counter buckets[histogram_snapshot::BUCKETS];
+        counter sum;
+        void record(const uint64_t v) {
+            buckets[histogram_snapshot::index(v)].add();
+            sum.add(v);
+        }
+        void read(histogram_snapshot& s) const {
+            histogram_snapshot h;
+            for (int i=0; i<histogram_snapshot::BUCKETS; ++i) {
+                h.buckets[i] = buckets[i].get();
+                h.count += h.buckets[i];
+            }
+            h.sum = sum.get();
+            s.merge(h);
+        }
+    };
+
+    struct counters {
+        counter triggers;
+        counter drops;
+        counter runs;
+        counter expired;
+        counter cancelled;
+        counter slow;
+        counter failed;
+        histogram queue_wait;
+        histogram run_time;
+        histogram cpu_time;
+
+        void read(event_stats& s) const {
+            s.triggers += triggers.get();
+            s.drops += drops.get();
+            s.runs += runs.get();
+            s.expired += expired.get();
+            s.cancelled += cancelled.get();
+            s.slow += slow.get();
+            s.failed += failed.get();
+            queue_wait.read(s.queue_wait);
+            run_time.read(s.run_time);
+            cpu_time.read(s.cpu_time);
+        }
+    };
+
+    static const size_t CHUNK = 1024;           // slots per chunk
+    static const size_t MAX_CHUNKS = 4096;
+
+    /// the counters of one thread, slot -> counters, allocated on first use
+    struct shard {
+        std::atomic<std::atomic<counters*>*> chunks[MAX_CHUNKS]{};
+
+        ~shard() {
+            for (auto& c : chunks) {
+                auto chunk = c.load();
+                if (!chunk)
+                    continue;
+                for (size_t i=0; i<CHUNK; ++i) {
+                    delete chunk[i].load();
+                }
+                delete[] chunk;
+            }
+        }
+
+        counters* get(const uint32_t slot) {
+            auto& c = chunks[slot / CHUNK];
+            auto chunk = c.load(std::memory_order_acquire);
+            if (!chunk) {
+                chunk = new std::atomic<counters*>[CHUNK]{};
+                c.store(chunk, std::memory_order_release);
+            }
+            auto& p = chunk[slot % CHUNK];
+            auto cnt = p.load(std::memory_order_relaxed);
+            if (!cnt) {
+                cnt = new counters;
+                p.store(cnt, std::memory_order_release);
+            }
+            return cnt;
+        }
+
+        const counters* find(const uint32_t slot) const {
+            auto chunk = chunks[slot / CHUNK].load(std::memory_order_acquire);
+            return chunk ? chunk[slot % CHUNK].load(std::memory_order_acquire) : nullptr;
+        }
+    };
+
+    struct registry {
+        std::mutex lk;
+        std::vector<shard*> live;
+        std::unordered_map<uint32_t, event_stats> retired;  // of exited threads
+        std::atomic<uint32_t> next_slot{0};
+    };
+
+    static registry& reg() {
+        static auto r = new registry;   // leaked, threads may exit after main
+        return *r;
+    }
+
+    /// \internal registers the thread's shard, folds it into retired on exit
+    struct local {
+        shard* s = new shard;
+        local() {
+            std::lock_guard<std::mutex> lg(reg().lk);
+            reg().live.push_back(s);
+        }
+        ~local() {
+            auto& r = reg();
+            std::lock_guard<std::mutex> lg(r.lk);
+            for (size_t i=0; i<MAX_CHUNKS; ++i) {
+                auto chunk = s->chunks[i].load();
+                for (size_t j=0; chunk && j<CHUNK; ++j) {
+                    if (auto c = chunk[j].load())
+                        c->read(r.retired[i * CHUNK + j]);
+                }
+            }
+            r.live.erase(std::find(r.live.begin(), r.live.end(), s));
+            delete s;
+        }
+    };
+
+    static counters* mine(const uint32_t slot) {
+        static thread_local local l;
+        return l.s->get(slot);
+    }
+
+public:
+    static bool enabled() { return EVENT_MANAGER_METRICS; }
+
+    static uint32_t new_slot() {
+        uint32_t slot = reg().next_slot.fetch_add(1);
+        return slot < CHUNK * MAX_CHUNKS ? slot : NO_SLOT;
+    }
+
+    static void on_trigger(const uint32_t slot) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->triggers.add();
+#endif
+    }
+
+    static void on_drop(const uint32_t slot) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->drops.add();
+#endif
+    }
+
+    static void on_expire(const uint32_t slot) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->expired.add();
+#endif
+    }
+
+    static void on_cancel(const uint32_t slot) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->cancelled.add();
+#endif
+    }
+
+    static void on_run(const uint32_t slot, const uint64_t wait_ns, const uint64_t run_ns) {
+#if EVENT_MANAGER_METRICS
+        if (slot == NO_SLOT)
+            return;
+        auto c = mine(slot);
+        c->runs.add();
+        c->queue_wait.record(wait_ns);
+        c->run_time.record(run_ns);
+#endif
+    }
+
+    /// \p cpu_ns of thread cpu time one run of \p slot took
+    static void on_cpu(const uint32_t slot, const uint64_t cpu_ns) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->cpu_time.record(cpu_ns);
+#endif
+    }
+
+    /// a run of \p slot went over the watchdog's threshold
+    static void on_slow(const uint32_t slot) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->slow.add();
+#endif
+    }
+
+    /// a run of \p slot threw
+    static void on_fail(const uint32_t slot) {
+#if EVENT_MANAGER_METRICS
+        if (slot != NO_SLOT)
+            mine(slot)->failed.add();
+#endif
+    }
+
+    /// aggregate the counters of \p slot over all threads
+    static event_stats read(const uint32_t slot) {
+        event_stats s;
+#if EVENT_MANAGER_METRICS
+        if (slot == NO_SLOT)
+            return s;
+        auto& r = reg();
+        std::lock_guard<std::mutex> lg(r.lk);
+        for (auto sh : r.live) {
+            if (auto c = sh->find(slot))
+                c->read(s);
+        }
+        auto it = r.retired.find(slot);
+        if (it != r.retired.end())
+            s.merge(it->second);
+#endif
+        return s;
+    }
+};
+
+#endif //EVENT_MANAGER_METRICS_H
@@ -0,0 +1,212 @@
+//
+// Created by zelin on 2022/7/11.
+//
+
+#ifndef EVENT_MANAGER_RATELIMIT_H
+#define EVENT_MANAGER_RATELIMIT_H
+
+#include "handle.h"
+#include "noncopyable.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+
+/// a token bucket as GCRA: the whole state is the theoretical arrival time of
+/// the next token, so admitting is one load and one CAS, no lock
+class TokenBucket : public noncopyable {
+private:
+    std::atomic<int64_t> tat_{0};   ///< ns, steady clock
+    const int64_t interval_;        ///< ns per token
+    const int64_t tolerance_;       ///< how far tat_ may run ahead of now
+
+    /// longest interval or tolerance, ns: about 146 years, so adding them
+    /// to a steady clock reading can't overflow
+    static constexpr double MAX_NS = 4611686018427387904.0;     // 2^62
+
+    static int64_t interval(const double rate, const double burst) {
+        if (!valid(rate, burst))
+            throw std::invalid_argument("token bucket: rate must be > 0 and burst >= 1");
+        return std::max<int64_t>(1, static_cast<int64_t>(1e9 / rate));
+    }
+
+public:
+    /// \p rate tokens per second, up to \p burst at once.
+    /// throws std::invalid_argument unless valid()
+    TokenBucket(const double rate, const double burst) :
+            interval_(interval(rate, burst)),
+            tolerance_(static_cast<int64_t>(burst * interval_)) {}
+
+    /// \p rate > 0 and \p burst >= 1, and the time \p burst tokens take fits
+    static bool valid(const double rate, const double burst) {
+        return rate > 0 && burst >= 1 && 1e9 / rate * burst < MAX_NS;
+    }
+
+    static int64_t now() {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                std::chrono::steady_clock::now().time_since_epoch()).count();
+    }
+
+    /// take a token if there is one
+    bool try_acquire(const int64_t now = TokenBucket::now()) {
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        while (true) {
+            int64_t next = std::max(tat, now) + interval_;
+            if (next - now > tolerance_)
+                return false;
+            if (tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+                return true;
+        }
+    }
+
+    /// take the next token even if it is in the future, unless that is more
+    /// than \p max_wait ns away.
+    /// \return the ns to wait until the token is due, -1 if it is too far
+    int64_t reserve(const int64_t max_wait, const int64_t now = TokenBucket::now()) {
+        int64_t tat = tat_.load(std::memory_order_relaxed);
+        while (true) {
+            int64_t next = std::max(tat, now) + interval_;
+            int64_t wait = std::max<int64_t>(0, next - now - tolerance_);
+            if (wait > max_wait)
+                return -1;
+            if (tat_.compare_exchange_weak(tat, next, std::memory_order_relaxed))
+                return wait;
+        }
+    }
+};
+
+/// what happens to a trigger over its limit
+enum class limit_policy {
+    reject,     ///< refused with EP_REJECTED
+    delay,      ///< the triggering thread sleeps until it conforms, at most max_delay
+    coalesce,   ///< merged into the trigger of the event already queued, if any
+};
+
+struct rate_limit {
+    double rate = 1000;     ///< triggers per second
+    double burst = 1;       ///< triggers admitted at once
+    limit_policy policy = limit_policy::reject;
+    std::chrono::microseconds max_delay{1000};  ///< for limit_policy::delay
+};
+
+/// what the limits did to the triggers of an event
+struct limit_stats {
+    uint64_t admitted = 0;
+    uint64_t rejected = 0;
+    uint64_t delayed = 0;       ///< admitted after a sleep
+    uint64_t coalesced = 0;     ///< merged into the queued trigger
+};
+
+/// the limits of one event: its own bucket and optionally its group's,
+/// both have to admit a trigger
+class RateLimiter : public noncopyable {
+public:
+    enum verdict { admit, reject, coalesced };
+
+private:
+    /// \internal runs the event and marks it as no longer queued, or marks
+    /// it when dropped without running, e.g. expired or cancelled
+    class tracked_handle : public handle_base {
+    private:
+        handle_ptr_t inner_;
+        std::shared_ptr<std::atomic<int>> queued_;
+        bool started_ = false;
+    public:
+        tracked_handle(handle_ptr_t inner, std::shared_ptr<std::atomic<int>> queued) :
+                inner_(std::move(inner)),
+                queued_(std::move(queued)) {}
+        ~tracked_handle() override {
+            if (!started_)
+                queued_->fetch_sub(1, std::memory_order_acq_rel);
+        }
+        void run() override {
+            if (!started_) {
+                started_ = true;
+                queued_->fetch_sub(1, std::memory_order_acq_rel);
+            }
+            inner_->run();
+        }
+    };
+
+    struct counter {
+        std::atomic<uint64_t> v{0};
+        void inc() { v.fetch_add(1, std::memory_order_relaxed); }
+        uint64_t get() const { return v.load(std::memory_order_relaxed); }
+    };
+
+    TokenBucket bucket_;
+    const rate_limit limit_;
+    std::shared_ptr<TokenBucket> group_;
+    /// triggers queued and not running yet, for limit_policy::coalesce
+    std::shared_ptr<std::atomic<int>> queued_;
+    counter admitted_, rejected_, delayed_, coalesced_;
+
+public:
+    RateLimiter(const rate_limit& limit, std::shared_ptr<TokenBucket> group) :
+            bucket_(limit.rate, limit.burst),
+            limit_(limit),
+            group_(std::move(group)),
+            queued_(std::make_shared<std::atomic<int>>(0)) {}
+
+    /// decide on one trigger. with limit_policy::delay this may sleep, and
+    /// reserves a token only from the bucket(s) that refused.
+    /// the tokens taken from the event's bucket are not given back when the
+    /// group refuses for good
+    verdict check() {
+        const int64_t now = TokenBucket::now();
+        const bool own = bucket_.try_acquire(now);
+        if (own && (!group_ || group_->try_acquire(now))) {
+            admitted_.inc();
+            return admit;
+        }
+        switch (limit_.policy) {
+        case limit_policy::delay: {
+            const int64_t max_wait = std::chrono::nanoseconds(limit_.max_delay).count();
+            // the group is never asked once the event's bucket refused
+            int64_t wait = own ? 0 : bucket_.reserve(max_wait, now);
+            int64_t group_wait = wait >= 0 && group_ ? group_->reserve(max_wait, now) : 0;
+            if (wait < 0 || group_wait < 0)
+                break;
+            std::this_thread::sleep_for(std::chrono::nanoseconds(std::max(wait, group_wait)));
+            delayed_.inc();
+            admitted_.inc();
+            return admit;
+        }
+        case limit_policy::coalesce:
+            if (queued_->load(std::memory_order_acquire) > 0) {
+                coalesced_.inc();
+                return coalesced;
+            }
+            // nothing to merge into, let this one be it
+            admitted_.inc();
+            return admit;
+        case limit_policy::reject:
+            break;
+        }
+        rejected_.inc();
+        return reject;
+    }
+
+    /// the handle to queue for an admitted trigger
+    handle_ptr_t wrap(handle_ptr_t h) {
+        if (limit_.policy != limit_policy::coalesce)
+            return h;
+        queued_->fetch_add(1, std::memory_order_acq_rel);
+        return std::make_shared<tracked_handle>(std::move(h), queued_);
+    }
+
+    /// later triggers merge into the queued one, see limit_policy::coalesce
+    bool coalesces() const {
+        return limit_.policy == limit_policy::coalesce;
+    }
+
+    limit_stats stats() const {
+        return limit_stats{admitted_.get(), rejected_.get(), delayed_.get(), coalesced_.get()};
+    }
+};
+
+#endif //EVENT_MANAGER_RATELIMIT_H
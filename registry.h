@@ -0,0 +1,248 @@
+//
+// Created by zelin on 2022/7/20.
+//
+
+#ifndef EVENT_MANAGER_REGISTRY_H
+#define EVENT_MANAGER_REGISTRY_H
+
+#include "handle.h"
+#include "metrics.h"
+#include "noncopyable.h"
+
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+/// a registry for millions of events sharing a few handlers, which differ
+/// only in their trivially copyable args, e.g. one event per entity:
+/// \code
+/// CompactRegistry& reg = ep.compact_registry();
+/// int temp = reg.add_handler<uint32_t, float>("temp", [](uint32_t id, float limit) {...});
+/// reg.add("sensor.1234.temp", temp, 1234u, 80.f);
+/// ep.trigger_compact("sensor.1234.temp");
+/// \endcode
+/// an event costs one 16 byte slot of an open addressing table, its key in
+/// one char arena and its packed args in the arena of its handler, no
+/// allocation of its own. a trigger unpacks the args into a new handle.
+///
+/// not thread safe: add and remove before triggering, like register_callback()
+class CompactRegistry : public noncopyable {
+private:
+    static const uint16_t EMPTY = 0xffff;
+    static const uint16_t TOMBSTONE = 0xfffe;
+    static const size_t MAX_KEY = 0xffff;
+
+    struct slot {
+        uint32_t hash;
+        uint32_t key;       ///< offset in keys_
+        uint32_t args;      ///< index in the args arena of its handler
+        uint16_t key_len;
+        uint16_t handler;   ///< EMPTY, TOMBSTONE or the index in handlers_
+    };
+    static_assert(sizeof(slot) == 16, "slot should stay 16 bytes");
+
+    struct handler_t {
+        std::string name;
+        handle_ptr_t proto;         ///< makes the handles, see handle_base::from_bytes()
+        const void* type;           ///< of the args, see type_tag()
+        size_t args_size;
+        std::vector<char> args;     ///< args_size bytes per event
+        std::vector<uint32_t> free; ///< unused entries of args
+        uint32_t metrics = Metrics::new_slot();
+    };
+
+    std::vector<slot> slots_;
+    std::vector<char> keys_;
+    std::vector<handler_t> handlers_;
+    size_t size_ = 0;
+    size_t tombstones_ = 0;
+    size_t dead_key_bytes_ = 0;
+
+public:
+    CompactRegistry() = default;
+
+    /// add a handler the events can share, \tparam Args have to be trivially
+    /// copyable and default constructible
+    /// \return its index, -1 if there are too many
+    template<typename ...Args>
+    int add_handler(const std::string& name, type_identity_t<std::function<void(Args...)>> func) {
+        static_assert(is_trivially_packable<Args...>::value,
+                      "the compact registry keeps trivially copyable args only");
+        if (handlers_.size() >= TOMBSTONE)
+            return -1;
+        handler_t h;
+        h.name = name;
+        h.proto = std::make_shared<handle<void(Args...)>>(func, std::decay_t<Args>()...);
+        h.type = type_tag<std::decay_t<Args>...>();
+        h.args_size = packed_size<Args...>();
+        handlers_.emplace_back(std::move(h));
+        return static_cast<int>(handlers_.size() - 1);
+    }
+
+    /// register \p id to run \p handler with \p args, which have to be the
+    /// types it was added with
+    /// \return 0, -1 if \p id is taken or too long, or \p handler or \p args don't fit
+    template<typename ...Args>
+    int add(std::string_view id, const int handler, const Args&... args) {
+        if (handler < 0 || size_t(handler) >= handlers_.size() || id.size() > MAX_KEY ||
+            keys_.size() + id.size() > UINT32_MAX)
+            return -1;
+        auto& h = handlers_[handler];
+        if (h.type != type_tag<std::decay_t<Args>...>())
+            return -1;
+        const uint32_t hash = hash_of(id);
+        if (find(id, hash) != nullptr)
+            return -1;
+        if ((size_ + tombstones_ + 1) * 10 > slots_.size() * 7)
+            rehash(size_ + 1);     // doubles, or drops the tombstones
+
+        uint32_t a;
+        if (!h.free.empty()) {
+            a = h.free.back();
+            h.free.pop_back();
+        } else {
+            a = static_cast<uint32_t>(h.args.size() / std::max<size_t>(1, h.args_size));
+            h.args.resize(h.args.size() + h.args_size);
+        }
+        if constexpr (sizeof...(Args) > 0)
+            pack_args(h.args.data() + size_t(a) * h.args_size, args...);
+
+        slot& s = probe(hash);
+        if (s.handler == TOMBSTONE)
+            --tombstones_;
+        s.hash = hash;
+        s.key = static_cast<uint32_t>(keys_.size());
+        s.key_len = static_cast<uint16_t>(id.size());
+        s.args = a;
+        s.handler = static_cast<uint16_t>(handler);
+        keys_.insert(keys_.end(), id.begin(), id.end());
+        ++size_;
+        return 0;
+    }
+
+    /// \return 0, -1 if there is no such id
+    int remove(std::string_view id) {
+        slot* s = find(id, hash_of(id));
+        if (!s)
+            return -1;
+        handlers_[s->handler].free.push_back(s->args);
+        dead_key_bytes_ += s->key_len;
+        s->handler = TOMBSTONE;
+        --size_;
+        ++tombstones_;
+        return 0;
+    }
+
+    bool contains(std::string_view id) const {
+        return find(id, hash_of(id)) != nullptr;
+    }
+
+    /// a handle running the handler of \p id with its args, nullptr if there
+    /// is no such id. \p metrics is set to the metrics slot of the handler
+    handle_ptr_t make_handle(std::string_view id, uint32_t& metrics) const {
+        const slot* s = find(id, hash_of(id));
+        if (!s)
+            return nullptr;
+        const auto& h = handlers_[s->handler];
+        metrics = h.metrics;
+        return h.proto->from_bytes(h.args.data() + size_t(s->args) * h.args_size, h.args_size);
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+    /// the bytes held by the table and the arenas
+    size_t memory() const {
+        size_t n = slots_.capacity() * sizeof(slot) + keys_.capacity();
+        for (auto& h : handlers_) {
+            n += sizeof(h) + h.args.capacity() + h.free.capacity() * sizeof(uint32_t);
+        }
+        return n;
+    }
+
+    /// call \p f(name, metrics slot) for every handler
+    template <typename Func>
+    void for_each_handler(Func&& f) const {
+        for (auto& h : handlers_) {
+            f(h.name, h.metrics);
+        }
+    }
+
+private:
+    template<typename ...Args>
+    static const void* type_tag() {
+        static const char tag = 0;
+        return &tag;
+    }
+
+    static uint32_t hash_of(std::string_view id) {
+        // FNV-1a
+        uint32_t h = 2166136261u;
+        for (char c : id) {
+            h = (h ^ static_cast<unsigned char>(c)) * 16777619u;
+        }
+        return h;
+    }
+
+    bool key_is(const slot& s, std::string_view id) const {
+        return s.key_len == id.size() && !std::memcmp(keys_.data() + s.key, id.data(), id.size());
+    }
+
+    const slot* find(std::string_view id, const uint32_t hash) const {
+        if (slots_.empty())
+            return nullptr;
+        const size_t mask = slots_.size() - 1;
+        for (size_t i=hash & mask; ; i=(i + 1) & mask) {
+            const slot& s = slots_[i];
+            if (s.handler == EMPTY)
+                return nullptr;
+            if (s.handler != TOMBSTONE && s.hash == hash && key_is(s, id))
+                return &s;
+        }
+    }
+
+    slot* find(std::string_view id, const uint32_t hash) {
+        return const_cast<slot*>(static_cast<const CompactRegistry*>(this)->find(id, hash));
+    }
+
+    /// \internal the first free slot for \p hash, the table has room
+    slot& probe(const uint32_t hash) {
+        const size_t mask = slots_.size() - 1;
+        size_t i = hash & mask;
+        while (slots_[i].handler != EMPTY && slots_[i].handler != TOMBSTONE) {
+            i = (i + 1) & mask;
+        }
+        return slots_[i];
+    }
+
+    /// \internal rebuild the table with room for \p n, and the key arena
+    /// without the keys of removed events
+    void rehash(const size_t n) {
+        size_t cap = 16;
+        while (cap * 7 < n * 10) {
+            cap <<= 1;
+        }
+        std::vector<slot> old(cap, slot{0, 0, 0, 0, EMPTY});
+        old.swap(slots_);
+        std::vector<char> keys;
+        keys.reserve(keys_.size() - dead_key_bytes_);
+        for (auto& s : old) {
+            if (s.handler == EMPTY || s.handler == TOMBSTONE)
+                continue;
+            slot& t = probe(s.hash);
+            t = s;
+            t.key = static_cast<uint32_t>(keys.size());
+            keys.insert(keys.end(), keys_.begin() + s.key, keys_.begin() + s.key + s.key_len);
+        }
+        keys_.swap(keys);
+        tombstones_ = 0;
+        dead_key_bytes_ = 0;
+    }
+};
+
+#endif //EVENT_MANAGER_REGISTRY_H
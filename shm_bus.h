@@ -0,0 +1,329 @@
+//
+// Created by zelin on 2022/6/2.
+//
+
+#ifndef EVENT_MANAGER_SHM_BUS_H
+#define EVENT_MANAGER_SHM_BUS_H
+
+#include "handle.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+/// a bounded lock-free ring in shared memory, carrying (event id, packed args)
+/// messages between processes on the same host.
+/// any number of processes may publish, only one may consume (the event_pool
+/// attached to it). the consumer sleeps on a futex in the shared memory when
+/// the ring is empty. closing a bus, see close(), only closes it for this
+/// ShmBus: the other processes go on publishing and the messages wait in the
+/// ring until a consumer reopens it.
+///
+/// \code
+/// // receiver
+/// ShmBus bus("/ep_bus", ShmBus::create);
+/// event_pool ep;
+/// ep.register_callback("temp", [](int t) {...}, 0);
+/// ep.attach(bus);
+/// // sender, in another process
+/// ShmBus bus("/ep_bus");
+/// bus.publish("temp", 42);
+/// \endcode
+class ShmBus : public noncopyable {
+public:
+    enum open_mode { open_existing, create };
+
+    static const uint32_t DEFAULT_CAPACITY  = 4096;  ///< slots, power of 2
+    static const uint32_t DEFAULT_SLOT_SIZE = 128;   ///< bytes per slot
+    static const uint32_t MAX_SLOT_SIZE = 65536;     ///< the lengths in a slot are 16 bit
+
+private:
+    static const uint32_t MAGIC = 0x65706232;   // "epb2"
+
+    struct slot {
+        std::atomic<uint64_t> seq;
+        uint16_t id_len;
+        uint16_t payload_len;
+        // followed by the id, then the packed args
+
+        char* data() { return reinterpret_cast<char*>(this + 1); }
+    };
+    static_assert(MAX_SLOT_SIZE - sizeof(slot) <= UINT16_MAX, "id_len and payload_len must fit");
+
+    struct layout {
+        uint32_t magic;
+        uint32_t capacity;
+        uint32_t slot_size;
+        alignas(64) std::atomic<uint64_t> head;     // next slot to publish
+        alignas(64) std::atomic<uint64_t> tail;     // next slot to consume
+        alignas(64) std::atomic<uint32_t> futex;    // bumped on every publish
+        std::atomic<uint32_t> waiters;
+    };
+
+    static_assert(std::atomic<uint64_t>::is_always_lock_free &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+                  "shared memory atomics have to be lock free");
+
+    std::string name_;
+    bool owner_ = false;
+    size_t bytes_ = 0;
+    layout* shm_ = nullptr;
+    char* slots_ = nullptr;
+    // copied from the header once it is checked, another process can't
+    // change them under this one
+    uint32_t capacity_ = 0;
+    uint32_t slot_size_ = 0;
+    std::atomic<bool> closed_{false};   ///< this process's end, see close()
+
+public:
+    /// open (or with \p mode == create, create and initialize) the POSIX
+    /// shared memory object \p name. throws std::system_error on failure,
+    /// std::invalid_argument if \p capacity isn't a power of 2 or \p slot_size
+    /// not a multiple of 8 up to MAX_SLOT_SIZE
+    explicit ShmBus(const std::string& name,
+                    const open_mode mode = open_existing,
+                    const uint32_t capacity = DEFAULT_CAPACITY,
+                    const uint32_t slot_size = DEFAULT_SLOT_SIZE) :
+            name_(name),
+            owner_(mode == create) {
+        int flags = O_RDWR | (owner_ ? O_CREAT | O_EXCL : 0);
+        int fd = shm_open(name.c_str(), flags, 0600);
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), "shm_open " + name);
+        try {
+            init(fd, owner_, capacity, slot_size);
+        } catch (...) {
+            if (owner_)
+                shm_unlink(name.c_str());
+            throw;
+        }
+    }
+
+    /// map an already opened memory fd, e.g. from memfd_create() and passed to
+    /// the other process by fork() or SCM_RIGHTS. the fd is not taken over.
+    /// with \p init_ring set, the fd is sized and the ring initialized
+    ShmBus(const int fd, const bool init_ring,
+           const uint32_t capacity = DEFAULT_CAPACITY,
+           const uint32_t slot_size = DEFAULT_SLOT_SIZE) {
+        init(dup(fd), init_ring, capacity, slot_size);
+    }
+
+    ~ShmBus() {
+        if (shm_)
+            munmap(shm_, bytes_);
+        if (owner_ && !name_.empty())
+            shm_unlink(name_.c_str());
+    }
+
+    /// the largest packed args size a message for \p id can carry
+    size_t max_payload(const std::string& id) const {
+        size_t room = slot_size_ - sizeof(slot);
+        return id.size() < room ? room - id.size() : 0;
+    }
+
+    /// publish a trigger of \p id with \p args, which have to be trivially
+    /// copyable and must match the args the receiver registered \p id with.
+    /// \return 0 on success, -1 if the ring is full, the message too big or
+    /// this bus closed
+    template <typename ...Args>
+    int publish(const std::string& id, const Args&... args) {
+        static_assert(is_trivially_packable<Args...>::value,
+                      "args sent over shared memory have to be trivially copyable");
+        constexpr size_t n = packed_size<Args...>();
+        if (n > max_payload(id) || closed_.load(std::memory_order_relaxed))
+            return -1;
+        slot* s = claim();
+        if (!s)
+            return -1;
+        s->id_len = static_cast<uint16_t>(id.size());
+        s->payload_len = static_cast<uint16_t>(n);
+        std::memcpy(s->data(), id.data(), id.size());
+        pack_args(s->data() + id.size(), args...);
+        commit(s);
+        return 0;
+    }
+
+    /// consume one message, blocking while the ring is empty.
+    /// \p f is called as f(const char* id, size_t id_len, const void* payload,
+    /// size_t payload_len), the pointers are valid only inside the call.
+    /// \return false once this bus is closed, see close(). what is left in
+    /// the ring stays there
+    template <typename Func>
+    bool consume(Func&& f) {
+        while (true) {
+            uint32_t seen = shm_->futex.load();
+            if (closed_.load())
+                return false;
+            if (try_consume(f))
+                return true;
+            shm_->waiters.fetch_add(1);
+            if (!readable())
+                futex_wait(&shm_->futex, seen);
+            shm_->waiters.fetch_sub(1);
+        }
+    }
+
+    /// non blocking consume(), false if the ring is empty.
+    /// a message whose lengths don't fit in its slot was not written by
+    /// publish(), it is dropped without calling \p f
+    template <typename Func>
+    bool try_consume(Func&& f) {
+        uint64_t pos = shm_->tail.load(std::memory_order_relaxed);
+        slot* s = at(pos);
+        if (s->seq.load(std::memory_order_acquire) != pos + 1)
+            return false;
+        // read once, the checked lengths are the ones used
+        const size_t id_len = s->id_len, payload_len = s->payload_len;
+        const size_t room = slot_size_ - sizeof(slot);
+        if (id_len <= room && payload_len <= room - id_len)
+            f(static_cast<const char*>(s->data()), id_len,
+              static_cast<const void*>(s->data() + id_len), payload_len);
+        s->seq.store(pos + capacity_, std::memory_order_release);
+        shm_->tail.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+    /// close this end of the bus: publish() fails and consume() returns
+    /// false, waking up if it sleeps. the other processes are not affected
+    void close() {
+        closed_.store(true);
+        shm_->futex.fetch_add(1);
+        futex_wake(&shm_->futex);
+    }
+
+    /// undo close(), e.g. to attach a pool again
+    void reopen() {
+        closed_.store(false);
+    }
+
+private:
+    void init(const int fd, const bool init_ring,
+              uint32_t capacity, const uint32_t slot_size) {
+        if (fd < 0)
+            throw std::system_error(errno, std::system_category(), "shm fd");
+        if (init_ring) {
+            if (!valid(capacity, slot_size)) {
+                ::close(fd);
+                throw std::invalid_argument("capacity must be a power of 2 and slot_size "
+                                            "a multiple of 8 up to MAX_SLOT_SIZE");
+            }
+            bytes_ = sizeof(layout) + size_t(capacity) * slot_size;
+            if (ftruncate(fd, bytes_) < 0)
+                fail(fd, "ftruncate");
+        } else {
+            struct stat st{};
+            if (fstat(fd, &st) < 0)
+                fail(fd, "fstat");
+            bytes_ = st.st_size;
+            if (bytes_ < sizeof(layout)) {
+                ::close(fd);
+                throw std::runtime_error("shm bus is not initialized");
+            }
+        }
+        void* p = mmap(nullptr, bytes_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (p == MAP_FAILED)
+            fail(fd, "mmap");
+        ::close(fd);
+        shm_ = static_cast<layout*>(p);
+        slots_ = static_cast<char*>(p) + sizeof(layout);
+
+        if (init_ring) {
+            shm_->capacity = capacity;
+            shm_->slot_size = slot_size;
+            shm_->head.store(0);
+            shm_->tail.store(0);
+            shm_->futex.store(0);
+            shm_->waiters.store(0);
+            capacity_ = capacity;
+            slot_size_ = slot_size;
+            for (uint32_t i=0; i<capacity; ++i) {
+                at(i)->seq.store(i);
+            }
+            std::atomic_thread_fence(std::memory_order_release);
+            shm_->magic = MAGIC;
+            return;
+        }
+        const bool magic = shm_->magic == MAGIC;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        capacity_ = shm_->capacity;
+        slot_size_ = shm_->slot_size;
+        if (!magic || !valid(capacity_, slot_size_) ||
+            bytes_ < sizeof(layout) + size_t(capacity_) * slot_size_) {
+            munmap(p, bytes_);
+            shm_ = nullptr;
+            throw std::runtime_error("not a shm bus: " + name_);
+        }
+    }
+
+    static bool valid(const uint32_t capacity, const uint32_t slot_size) {
+        return capacity && !(capacity & (capacity - 1)) &&
+               slot_size > sizeof(slot) && slot_size <= MAX_SLOT_SIZE &&
+               slot_size % alignof(slot) == 0;
+    }
+
+    [[noreturn]] static void fail(const int fd, const char* what) {
+        int err = errno;
+        ::close(fd);
+        throw std::system_error(err, std::system_category(), what);
+    }
+
+    slot* at(const uint64_t pos) const {
+        return reinterpret_cast<slot*>(slots_ + (pos & (capacity_ - 1)) * slot_size_);
+    }
+
+    bool readable() const {
+        uint64_t pos = shm_->tail.load();
+        return at(pos)->seq.load() == pos + 1;
+    }
+
+    /// \internal reserve the next free slot, nullptr if the ring is full
+    slot* claim() {
+        uint64_t pos = shm_->head.load(std::memory_order_relaxed);
+        while (true) {
+            slot* s = at(pos);
+            uint64_t seq = s->seq.load(std::memory_order_acquire);
+            auto diff = static_cast<int64_t>(seq - pos);
+            if (diff == 0) {
+                if (shm_->head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    return s;
+            } else if (diff < 0) {
+                return nullptr;
+            } else {
+                pos = shm_->head.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    /// \internal make a claimed slot visible and wake the consumer if it sleeps
+    void commit(slot* s) {
+        s->seq.store(s->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        shm_->futex.fetch_add(1);
+        if (shm_->waiters.load())
+            futex_wake(&shm_->futex);
+    }
+
+    // not FUTEX_PRIVATE_FLAG, the word is shared between processes
+    static void futex_wait(std::atomic<uint32_t>* word, const uint32_t expected) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAIT, expected,
+                nullptr, nullptr, 0);
+    }
+
+    static void futex_wake(std::atomic<uint32_t>* word) {
+        syscall(SYS_futex, reinterpret_cast<uint32_t*>(word), FUTEX_WAKE, 1,
+                nullptr, nullptr, 0);
+    }
+};
+
+#endif //EVENT_MANAGER_SHM_BUS_H
@@ -0,0 +1,212 @@
+//
+// Created by zelin on 2022/6/28.
+//
+
+#ifndef EVENT_MANAGER_TASKGRAPH_H
+#define EVENT_MANAGER_TASKGRAPH_H
+
+#include "handle.h"
+#include "noncopyable.h"
+#include "threadpool.h"
+
+#include <atomic>
+#include <cstdint>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <vector>
+
+/// a DAG of handles run on a ThreadPool: a node runs once all the nodes it
+/// depends on have run.
+///
+/// each run keeps a join counter per node. the worker finishing a node
+/// decrements its successors' counters and goes on with the first successor
+/// that became ready itself, without another trip through the queues, the
+/// other ready ones are added to the pool as tasks.
+///
+/// \code
+/// TaskGraph g;
+/// auto parse = g.add([]() {...});
+/// auto a = g.add([]() {...}), b = g.add(ep.get_handle("b"));
+/// auto join = g.add([]() {...});
+/// g.precede(parse, a); g.precede(parse, b);
+/// g.precede(a, join); g.precede(b, join);     // join waits for both
+/// ep.run_graph(g).wait();
+/// \endcode
+///
+/// \note don't change the graph while it runs, and keep it alive until the
+/// future returned by run() is ready
+class TaskGraph : public noncopyable {
+public:
+    using node_t = size_t;
+    static const node_t npos = SIZE_MAX;
+
+private:
+    struct node {
+        handle_ptr_t handle;
+        std::vector<node_t> successors;
+        int32_t n_deps = 0;
+    };
+
+    /// \internal one run(), reused by its repeats
+    struct run_state {
+        const TaskGraph* g;
+        ThreadPool* pool;
+        std::unique_ptr<std::atomic<int32_t>[]> pending;
+        std::atomic<size_t> remaining{0};
+        size_t repeats;
+        std::promise<void> done;
+        std::atomic_bool failed{false};
+
+        run_state(const TaskGraph* g, ThreadPool* pool, size_t repeats) :
+                g(g),
+                pool(pool),
+                pending(new std::atomic<int32_t>[g->nodes_.size()]),
+                repeats(repeats) {}
+    };
+    using run_ptr_t = std::shared_ptr<run_state>;
+
+    std::vector<node> nodes_;
+    std::vector<node_t> roots_;
+    bool checked_ = false;
+
+public:
+    /// \return the new node, npos if \p h is null
+    node_t add(handle_ptr_t h) {
+        if (!h)
+            return npos;
+        nodes_.push_back(node{std::move(h)});
+        checked_ = false;
+        return nodes_.size() - 1;
+    }
+
+    template<typename Func,
+             std::enable_if_t<!std::is_convertible<Func, handle_ptr_t>::value, int> = 0>
+    node_t add(Func func) {
+        return add(std::make_shared<handle<void()>>(func));
+    }
+
+    /// \p before has to finish before \p after starts
+    /// \return 0, or -1 for an unknown node
+    int precede(const node_t before, const node_t after) {
+        if (before >= nodes_.size() || after >= nodes_.size())
+            return -1;
+        nodes_[before].successors.push_back(after);
+        ++nodes_[after].n_deps;
+        checked_ = false;
+        return 0;
+    }
+
+    size_t size() const {
+        return nodes_.size();
+    }
+
+    /// run the graph \p times times, one run after the other, on \p pool.
+    /// the future is ready once the last run finished. it holds a
+    /// std::invalid_argument if the graph has a cycle, and a std::runtime_error
+    /// if the pool refused a task because it is shutting down.
+    /// if a node throws, the future holds its exception right away: none of
+    /// its successors run, and no more nodes or repeats start. the nodes
+    /// already running finish
+    std::future<void> run(ThreadPool& pool, const size_t times = 1) {
+        auto rs = std::make_shared<run_state>(this, &pool, times);
+        auto future = rs->done.get_future();
+        if (!check()) {
+            rs->done.set_exception(std::make_exception_ptr(
+                    std::invalid_argument("task graph has a cycle")));
+        } else if (nodes_.empty() || times == 0) {
+            rs->done.set_value();
+        } else {
+            start(rs);
+        }
+        return future;
+    }
+
+private:
+    /// \internal find the roots, false if there is a cycle (Kahn's algorithm)
+    bool check() {
+        if (checked_)
+            return true;
+        std::vector<int32_t> deps(nodes_.size());
+        std::vector<node_t> ready;
+        for (node_t i=0; i<nodes_.size(); ++i) {
+            deps[i] = nodes_[i].n_deps;
+            if (!deps[i])
+                ready.push_back(i);
+        }
+        roots_ = ready;
+        size_t seen = 0;
+        while (!ready.empty()) {
+            node_t n = ready.back();
+            ready.pop_back();
+            ++seen;
+            for (node_t s : nodes_[n].successors) {
+                if (--deps[s] == 0)
+                    ready.push_back(s);
+            }
+        }
+        checked_ = seen == nodes_.size();
+        return checked_;
+    }
+
+    static void start(const run_ptr_t& rs) {
+        const auto& nodes = rs->g->nodes_;
+        for (node_t i=0; i<nodes.size(); ++i) {
+            rs->pending[i].store(nodes[i].n_deps, std::memory_order_relaxed);
+        }
+        rs->remaining.store(nodes.size(), std::memory_order_release);
+        for (node_t r : rs->g->roots_) {
+            submit(rs, r);
+        }
+    }
+
+    static void submit(const run_ptr_t& rs, const node_t n) {
+        if (rs->failed)
+            return;
+        int ret = rs->pool->add_task(std::make_shared<handle<void()>>([rs, n]() {
+            execute(rs, n);
+        }));
+        if (ret != 0 && !rs->failed.exchange(true))
+            rs->done.set_exception(std::make_exception_ptr(
+                    std::runtime_error("task graph: the pool is shutting down")));
+    }
+
+    /// \internal run \p n, then the chain of successors it makes ready
+    static void execute(const run_ptr_t& rs, node_t n) {
+        const auto& nodes = rs->g->nodes_;
+        while (n != npos && !rs->failed.load(std::memory_order_relaxed)) {
+            try {
+                nodes[n].handle->run();
+            } catch (...) {
+                if (!rs->failed.exchange(true))
+                    rs->done.set_exception(std::current_exception());
+                return;     // its successors never become ready
+            }
+            node_t next = npos;
+            for (node_t s : nodes[n].successors) {
+                if (rs->pending[s].fetch_sub(1, std::memory_order_acq_rel) != 1)
+                    continue;
+                if (next == npos)
+                    next = s;           // continue with it on this worker
+                else
+                    submit(rs, s);
+            }
+            // after the successors are out, so remaining can't hit 0 early
+            if (rs->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                finish(rs);
+            n = next;
+        }
+    }
+
+    static void finish(const run_ptr_t& rs) {
+        if (rs->failed)
+            return;
+        if (--rs->repeats > 0)
+            start(rs);
+        else
+            rs->done.set_value();
+    }
+};
+
+#endif //EVENT_MANAGER_TASKGRAPH_H
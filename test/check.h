@@ -0,0 +1,17 @@
+//
+// Created by zelin on 2022/6/24.
+//
+
+#ifndef EVENT_MANAGER_TEST_CHECK_H
+#define EVENT_MANAGER_TEST_CHECK_H
+
+#include <cstdio>
+
+/// print \p what with ok or FAILED.
+/// \return 1 if it failed, the tests add these up into their exit code
+inline int check(const bool ok, const char* what) {
+    printf("%s: %s\n", what, ok ? "ok" : "FAILED");
+    return ok ? 0 : 1;
+}
+
+#endif //EVENT_MANAGER_TEST_CHECK_H
@@ -0,0 +1,83 @@
+//
+// Created by zelin on 2022/7/29.
+//
+#include "event_pool.h"
+#include "check.h"
+
+#include <string>
+#include <thread>
+
+int main() {
+    int failed = 0;
+    const int producers = 4;
+    const int n = 20000;
+    const long total = long(producers) * n;
+    std::vector<std::atomic_int> hits(total);
+    std::atomic_int runs{0}, plain{0}, torn{0};
+    {
+        event_pool ep(4);
+        // the three args only ever change together, no lock in the handler
+        ep.register_callback("set", [&](long a, long b, std::string s) {
+            if (b != ~a || s != std::to_string(a))
+                ++torn;
+            if (a >= 0 && a < total)
+                ++hits[a];
+            ++runs;
+        }, -1L, ~-1L, std::string("-1"));
+
+        std::atomic_bool go{false};
+        std::vector<std::thread> threads;
+        for (int p=0; p<producers; ++p) {
+            threads.emplace_back([&, p]() {
+                while (!go) {}
+                for (long i=p; i<long(producers) * n; i+=producers) {
+                    ep.trigger_and_set("set", i, ~i, std::to_string(i));
+                    if (i % 7 == 0 && ep.trigger_callback("set") == 0)
+                        ++plain;    // whatever was set last
+                }
+            });
+        }
+        go = true;
+        for (auto& t : threads) {
+            t.join();
+        }
+        ep.shutdown(shutdown_mode::drain);
+    }
+    failed += check(torn == 0, "no torn args");
+    bool all = runs == total + plain;
+    for (long i=0; all && i<total; ++i) {
+        all = hits[i] > 0;
+    }
+    failed += check(all, "every trigger_and_set ran with its own args");
+    {
+        event_pool ep(1);
+        std::atomic_bool hold{true};
+        std::vector<int> seen;
+        ep.register_callback("hold", [&hold]() { while (hold) {} });
+        ep.register_callback("v", [&seen](int v) { seen.push_back(v); }, 0);
+        ep.trigger_callback("hold");
+        for (int i=1; i<=40; ++i) {
+            ep.trigger_and_set("v", i);     // more than are kept, the rest allocate
+        }
+        ep.trigger_callback("v");
+        hold = false;
+        ep.shutdown(shutdown_mode::drain);
+        bool in_order = seen.size() == 41 && seen.back() == 40;
+        for (int i=0; in_order && i<40; ++i) {
+            in_order = seen[i] == i + 1;
+        }
+        failed += check(in_order, "queued triggers keep their args");
+    }
+    {
+        // registered as a handle, its args are still set
+        event_pool ep(1);
+        std::vector<int> seen;
+        ep.register_callback("plain", std::make_shared<handle<void(int)>>(
+                [&seen](int v) { seen.push_back(v); }, 1));
+        failed += check(ep.trigger_and_set("plain", 7) == 0, "plain handle set");
+        ep.trigger_callback("plain");
+        ep.shutdown(shutdown_mode::drain);
+        failed += check(seen == std::vector<int>{7, 7}, "plain handle runs with the args set");
+    }
+    return failed;
+}
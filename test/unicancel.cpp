@@ -0,0 +1,62 @@
+//
+// Created by zelin on 2022/7/15.
+//
+#include "cancel.h"
+#include "event_pool.h"
+#include "check.h"
+
+#include <unistd.h>
+
+int main() {
+    int failed = 0;
+    event_pool ep(1);
+    std::atomic_bool hold{true};
+    std::atomic_int ran{0}, sum{0}, merged{0};
+    ep.register_callback("hold", [&hold]() { while (hold) usleep(100); });
+    ep.register_callback("tick", [&ran]() { ++ran; });
+    ep.register_callback("add", [&sum](int v) { sum += v; }, 0);
+    ep.register_callback("merge", [&merged]() { ++merged; });
+    ep.limit_event("merge", rate_limit{1, 1, limit_policy::coalesce});
+
+    ep.trigger_callback("hold");
+    usleep(5000);
+    cancel_token a, b, none;
+    ep.trigger_cancellable("add", a, 1);
+    ep.trigger_cancellable("add", b, 10);
+    failed += check(ep.trigger_cancellable("nope", none) == EP_NOT_FOUND && !none.valid(),
+                    "no token on error");
+    failed += check(a.cancel() && a.cancelled() && !a.cancel(), "cancel once");
+    for (int i=0; i<5; ++i) {
+        ep.trigger_callback("tick");
+    }
+    ep.cancel_pending("tick");
+    ep.trigger_callback("tick");        // after the cancel, runs
+    for (int i=0; i<3; ++i) {
+        ep.trigger_callback("merge");   // the first is queued, the others merge into it
+    }
+    ep.cancel_pending("merge");
+    ep.trigger_callback("add", 100);
+    ep.unregister_callback("add");
+    hold = false;
+    usleep(50000);
+
+    failed += check(sum == 0, "unregister drops queued");
+    failed += check(ran == 1, "cancel_pending");
+    failed += check(!b.cancel(), "dropped ones can't be cancelled");
+    // nothing of "merge" is queued anymore, so this one is not merged away
+    ep.trigger_callback("merge");
+    usleep(20000);
+    failed += check(merged == 1, "coalesce after cancel");
+
+    ep.register_callback("add", [&sum](int v) { sum += v; }, 0);
+    cancel_token c;
+    ep.trigger_cancellable("add", c, 5);
+    usleep(20000);
+    failed += check(sum == 5 && !c.cancel(), "too late to cancel");
+
+    for (auto& e : ep.metrics().events) {
+        if (e.first == "tick")
+            failed += check(!Metrics::enabled() || e.second.cancelled == 5, "cancelled counted");
+    }
+    return failed;
+}
@@ -0,0 +1,79 @@
+//
+// Created by zelin on 2022/7/13.
+//
+#include "event_pool.h"
+#include "threadpool.h"
+#include "check.h"
+
+#include <unistd.h>
+
+using namespace std::chrono;
+
+int main() {
+    int failed = 0;
+    {
+        // while the worker is held, queue deadlines out of order
+        ThreadPool tp(1);
+        std::atomic_bool hold{true}, held{false};
+        std::vector<int> order;
+        std::atomic_int expired{0};
+        tp.add_task([&hold, &held]() { held = true; while (hold) usleep(100); });
+        while (!held) usleep(100);
+        uint64_t now = metrics_now_ns();
+        auto note = [&order](int v) {
+            return std::make_shared<handle<void(int)>>([&order](int v) { order.push_back(v); }, v);
+        };
+        auto on_expire = std::make_shared<handle<void()>>([&expired]() { ++expired; });
+        tp.add_task(note(0), Metrics::NO_SLOT);                     // no deadline, goes last
+        tp.add_task(note(3), Metrics::NO_SLOT, now + 3000000000);
+        tp.add_task(note(1), Metrics::NO_SLOT, now + 1000000000);
+        tp.add_task(note(2), Metrics::NO_SLOT, now + 2000000000);
+        for (int i=0; i<5; ++i) {
+            tp.add_task(note(-1), Metrics::NO_SLOT, now + 1000000, on_expire);   // 1ms
+        }
+        usleep(10000);
+        hold = false;
+        tp.shutdown(shutdown_mode::drain);
+        failed += check(order == std::vector<int>{1, 2, 3, 0}, "earliest deadline first");
+        failed += check(expired == 5 && tp.stats()[0].expired == 5, "late ones skipped");
+    }
+    {
+        event_pool ep(1);
+        std::atomic_bool hold{true}, held{false};
+        std::atomic_int ran{0}, expired{0};
+        ep.register_callback("hold", [&hold, &held]() { held = true; while (hold) usleep(100); });
+        ep.register_callback("fast", [&ran]() { ++ran; });
+        ep.register_callback("arg", [&ran](int v) { ran += v; }, 0);
+        ep.set_deadline("fast", milliseconds(50),
+                        std::make_shared<handle<void()>>([&expired]() { ++expired; }));
+        failed += check(ep.set_deadline("none", milliseconds(1)) == -1, "unknown id");
+
+        ep.trigger_callback("hold");
+        while (!held) usleep(100);
+        for (int i=0; i<10; ++i) {
+            ep.trigger_callback("fast");
+        }
+        ep.trigger_with_deadline("arg", metrics_clock::now() + milliseconds(1), 100);
+        ep.trigger_with_deadline("arg", metrics_clock::now() + seconds(10), 7);
+        failed += check(ep.trigger_with_deadline("arg", metrics_clock::now(), "bad") == EP_NOT_FOUND,
+                        "args mismatch");
+        usleep(100000);    // well past the budget of "fast"
+        hold = false;
+        usleep(20000);
+        ep.trigger_callback("fast");
+        usleep(20000);
+
+        uint64_t fast_expired = 0, arg_expired = 0;
+        for (auto& e : ep.metrics().events) {
+            if (e.first == "fast")
+                fast_expired = e.second.expired;
+            if (e.first == "arg")
+                arg_expired = e.second.expired;
+        }
+        printf("ran %d expired %d\n", ran.load(), expired.load());
+        failed += check(ran == 8 && expired == 10, "budget");
+        failed += check(!Metrics::enabled() || (fast_expired == 10 && arg_expired == 1),
+                        "expired counted");
+    }
+    return failed;
+}
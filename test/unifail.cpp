@@ -0,0 +1,105 @@
+//
+// Created by zelin on 2022/7/27.
+//
+#include "event_pool.h"
+#include "threadpool.h"
+#include "check.h"
+
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+static void wait_for(const std::atomic_int& v, const int n) {
+    for (int i=0; v < n && i<2000; ++i) {
+        usleep(1000);
+    }
+}
+
+int main() {
+    int failed = 0;
+    {
+        // every other task throws, the workers keep going
+        ThreadPool tp(2);
+        std::atomic_int ran{0}, errors{0};
+        tp.on_error([&errors](uint32_t, std::exception_ptr err) {
+            try {
+                std::rethrow_exception(err);
+            } catch (const std::runtime_error&) {
+                ++errors;
+            }
+        });
+        for (int i=0; i<1000; ++i) {
+            if (i % 2)
+                tp.add_task([]() { throw std::runtime_error("odd"); });
+            else
+                tp.add_task([&ran]() { ++ran; });
+        }
+        tp.shutdown(shutdown_mode::drain);
+        auto ws = tp.stats();
+        failed += check(ran == 500 && errors == 500, "thrown tasks isolated");
+        failed += check(ws[0].failed + ws[1].failed == 500 &&
+                        ws[0].tasks + ws[1].tasks == (Metrics::enabled() ? 1000u : 0u),
+                        "failures counted per worker");
+    }
+    {
+        event_pool ep(1);
+        std::mutex lk;
+        std::vector<std::string> errors;
+        std::atomic_int reported{0};    // after the breaker saw the failure
+        ep.on_error([&](const std::string& id, std::exception_ptr err) {
+            ++reported;
+            std::lock_guard<std::mutex> lg(lk);
+            try {
+                std::rethrow_exception(err);
+            } catch (const std::exception& e) {
+                errors.push_back(id + ":" + e.what());
+            }
+        });
+        std::atomic_bool fail{true}, hold{false};
+        std::atomic_int ran{0};
+        ep.register_callback("flaky", [&]() {
+            ++ran;
+            while (hold) usleep(100);
+            if (fail)
+                throw std::runtime_error("down");
+        });
+        failed += check(ep.set_breaker("none", 3, milliseconds(50)) == -1, "unknown id");
+        ep.set_breaker("flaky", 3, milliseconds(50));
+
+        for (int i=0; i<3; ++i) {
+            ep.trigger_callback("flaky");
+        }
+        wait_for(reported, 3);
+        failed += check(ep.trigger_callback("flaky") == EP_OPEN, "open after 3 failures");
+        failed += check(ep.circuit_stats("flaky").trips == 1 && ep.circuit_stats("flaky").open,
+                        "tripped");
+        usleep(60000);
+        failed += check(ep.trigger_callback("flaky") == 0, "half open after the cooldown");
+        wait_for(reported, 4);
+        failed += check(ep.trigger_callback("flaky") == EP_OPEN, "one more failure opens it");
+        usleep(60000);
+        fail = false;
+        hold = true;
+        failed += check(ep.circuit_stats("flaky").half_open && ep.trigger_callback("flaky") == 0,
+                        "the probe");
+        failed += check(ep.trigger_callback("flaky") == EP_OPEN, "one probe at a time");
+        hold = false;
+        wait_for(ran, 5);
+        usleep(1000);
+        auto cs = ep.circuit_stats("flaky");
+        failed += check(ep.trigger_callback("flaky") == 0 && !cs.open && !cs.half_open,
+                        "a success closes it");
+        ep.shutdown(shutdown_mode::drain);
+        {
+            std::lock_guard<std::mutex> lg(lk);
+            failed += check(errors.size() == 4 && errors[0] == "flaky:down", "errors routed with the id");
+        }
+        failed += check(ran == 6 && ep.circuit_stats("flaky").rejected == 3, "rejected not run");
+        if (Metrics::enabled()) {
+            auto s = ep.metrics().events[0].second;
+            failed += check(s.failed == 4 && s.runs == 6 && s.drops == 3, "event_stats::failed");
+        }
+    }
+    return failed;
+}
@@ -0,0 +1,99 @@
+//
+// Created by zelin on 2022/6/28.
+//
+#include "event_pool.h"
+#include "taskgraph.h"
+
+#include <stdexcept>
+#include <string>
+
+#include <unistd.h>
+
+int main() {
+    event_pool ep(3);
+    std::atomic_int a{0}, b{0}, c{0}, d{0};
+    std::atomic_int bad{0};
+    ep.register_callback("b", [&]() {
+        if (b.load() >= a.load())
+            ++bad;
+        ++b;
+    });
+
+    // diamond: a -> (b, c) -> d
+    TaskGraph g;
+    auto na = g.add([&]() { ++a; });
+    auto nb = g.add(ep.get_handle("b"));
+    auto nc = g.add([&]() {
+        if (c.load() >= a.load())
+            ++bad;
+        ++c;
+    });
+    auto nd = g.add([&]() {
+        if (d.load() >= b.load() || d.load() >= c.load())
+            ++bad;
+        ++d;
+    });
+    g.precede(na, nb);
+    g.precede(na, nc);
+    g.precede(nb, nd);
+    g.precede(nc, nd);
+    if (g.add(ep.get_handle("no such id")) != TaskGraph::npos || g.precede(na, 100) != -1)
+        return 1;
+
+    ep.run_graph(g).get();
+    ep.run_graph(g, 100).get();
+    printf("a %d b %d c %d d %d, out of order %d\n", a.load(), b.load(), c.load(), d.load(),
+           bad.load());
+    if (a != 101 || b != 101 || c != 101 || d != 101 || bad)
+        return 1;
+
+    // fan-in of many
+    TaskGraph fan;
+    std::atomic_int leaves{0};
+    int seen = -1;
+    auto sink = fan.add([&]() { seen = leaves.load(); });
+    for (int i=0; i<64; ++i) {
+        fan.precede(fan.add([&]() { ++leaves; }), sink);
+    }
+    ep.run_graph(fan).get();
+    if (seen != 64)
+        return 1;
+
+    // a cycle is refused
+    TaskGraph cyc;
+    auto x = cyc.add([]() {}), y = cyc.add([]() {});
+    cyc.precede(x, y);
+    cyc.precede(y, x);
+    try {
+        ep.run_graph(cyc).get();
+        return 1;
+    } catch (const std::invalid_argument&) {
+    }
+
+    // a node that throws fails the run, its successors don't run
+    TaskGraph thr;
+    std::atomic_int after{0};
+    auto t1 = thr.add([]() {}), t2 = thr.add([]() { throw std::out_of_range("node 2"); });
+    auto t3 = thr.add([&]() { ++after; });
+    thr.precede(t1, t2);
+    thr.precede(t2, t3);
+    try {
+        ep.run_graph(thr, 10).get();
+        return 1;
+    } catch (const std::out_of_range& e) {
+        if (std::string(e.what()) != "node 2")
+            return 1;
+    }
+    usleep(20000);
+    if (after != 0)
+        return 1;
+
+    // so is running on a stopped pool
+    ep.terminate();
+    try {
+        ep.run_graph(g).get();
+        return 1;
+    } catch (const std::runtime_error&) {
+    }
+    return 0;
+}
@@ -0,0 +1,116 @@
+//
+// Created by zelin on 2022/7/11.
+//
+#include "event_pool.h"
+#include "ratelimit.h"
+#include "check.h"
+
+#include <unistd.h>
+
+using namespace std::chrono;
+
+int main() {
+    int failed = 0;
+    {
+        // 1 per second with a burst of 5: the first 5 pass, the rest fail
+        TokenBucket b(1, 5);
+        int64_t now = TokenBucket::now();
+        int ok = 0;
+        for (int i=0; i<10; ++i) {
+            ok += b.try_acquire(now);
+        }
+        failed += check(ok == 5, "bucket burst");
+        failed += check(b.try_acquire(now + 1000000000), "bucket refills");
+        failed += check(b.reserve(500000000, now + 1000000000) == -1, "reserve too far");
+        failed += check(b.reserve(2000000000, now + 1000000000) > 0, "reserve waits");
+
+        bool threw = false;
+        try {
+            TokenBucket tiny(1e-12, 1);
+        } catch (const std::invalid_argument&) {
+            threw = true;
+        }
+        failed += check(threw && !TokenBucket::valid(0, 1) && !TokenBucket::valid(1, 0.5),
+                        "bucket limits checked");
+    }
+
+    event_pool ep(2);
+    std::atomic_int ran{0}, sum{0};
+    ep.register_callback("reject", [&ran]() { ++ran; });
+    ep.register_callback("delay", [&ran]() { ++ran; });
+    ep.register_callback("merge", [&sum](int v) { usleep(20000); sum += v; }, 0);
+    ep.register_callback("a", []() {});
+    ep.register_callback("b", []() {});
+
+    failed += check(ep.limit_event("none", rate_limit{}) == -1, "unknown id");
+    failed += check(ep.limit_event("a", rate_limit{}, "none") == -1, "unknown group");
+    failed += check(ep.limit_event("a", rate_limit{-1}) == -1 && ep.limit_group("g", 0, 1) == -1,
+                    "invalid limits");
+
+    ep.limit_event("reject", rate_limit{1, 3});
+    int rejected = 0;
+    for (int i=0; i<10; ++i) {
+        rejected += ep.trigger_callback("reject") == EP_REJECTED;
+    }
+    auto st = ep.rate_limit_stats("reject");
+    failed += check(rejected == 7 && st.admitted == 3 && st.rejected == 7, "reject");
+    uint64_t drops = 0;
+    for (auto& e : ep.metrics().events) {
+        if (e.first == "reject")
+            drops = e.second.drops;
+    }
+    failed += check(!Metrics::enabled() || drops == 7, "rejects are drops");
+
+    // 100/s, one at once: the 5th token is due 40ms after the 1st, and all pass
+    ep.limit_event("delay", rate_limit{100, 1, limit_policy::delay, milliseconds(100)});
+    auto start = steady_clock::now();
+    int ok = 0;
+    for (int i=0; i<5; ++i) {
+        ok += ep.trigger_callback("delay") == 0;
+    }
+    auto took = steady_clock::now() - start;
+    st = ep.rate_limit_stats("delay");
+    printf("delay: delayed %lu in %ldms\n", (unsigned long)st.delayed,
+           (long)duration_cast<milliseconds>(took).count());
+    failed += check(ok == 5 && st.delayed > 0 && st.delayed <= 4 &&
+                    took >= milliseconds(40) && took < milliseconds(200), "delay");
+
+    // the event's bucket admits, the group's refuses: only the group's
+    // token is waited for, the event keeps its second one
+    ep.register_callback("c", []() {});
+    ep.limit_group("cg", 100, 1);
+    ep.limit_event("c", rate_limit{1, 2, limit_policy::delay, milliseconds(100)}, "cg");
+    ok = 0;
+    for (int i=0; i<2; ++i) {
+        ok += ep.trigger_callback("c") == 0;
+    }
+    st = ep.rate_limit_stats("c");
+    failed += check(ok == 2 && st.delayed == 1, "delay for the group");
+
+    // the first one runs, the later ones merge into the one queued behind it
+    ep.limit_event("merge", rate_limit{1, 1, limit_policy::coalesce});
+    for (int i=1; i<=5; ++i) {
+        ep.trigger_and_set("merge", i);
+        usleep(1000);
+    }
+    usleep(100000);
+    st = ep.rate_limit_stats("merge");
+    printf("merge: admitted %lu coalesced %lu sum %d\n",
+           (unsigned long)st.admitted, (unsigned long)st.coalesced, sum.load());
+    failed += check(st.admitted + st.coalesced == 5 && st.coalesced > 0, "coalesce");
+
+    // "a" and "b" share 2 triggers
+    ep.limit_group("ab", 1, 2);
+    ep.limit_event("a", rate_limit{1000, 10}, "ab");
+    ep.limit_event("b", rate_limit{1000, 10}, "ab");
+    int passed = 0;
+    for (int i=0; i<3; ++i) {
+        passed += ep.trigger_callback("a") == 0;
+        passed += ep.trigger_callback("b") == 0;
+    }
+    failed += check(passed == 2, "group");
+
+    ep.unlimit_event("reject");
+    failed += check(ep.trigger_callback("reject") == 0, "unlimited");
+    return failed;
+}
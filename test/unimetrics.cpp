@@ -0,0 +1,55 @@
+//
+// Created by zelin on 2022/6/9.
+//
+#include "event_pool.h"
+#include "metrics.h"
+
+#include <unistd.h>
+
+int main() {
+    // histogram buckets
+    for (uint64_t v : {0ull, 1ull, 3ull, 4ull, 5ull, 7ull, 8ull, 1000ull, 123456789ull}) {
+        int i = histogram_snapshot::index(v);
+        if (histogram_snapshot::lower_bound(i) > v ||
+            (i + 1 < histogram_snapshot::BUCKETS && histogram_snapshot::lower_bound(i + 1) <= v)) {
+            printf("bad bucket %d for %llu\n", i, (unsigned long long) v);
+            return 1;
+        }
+    }
+
+    event_pool ep(2);
+    ep.register_callback("fast", []() {});
+    ep.register_callback("slow", [](int ms) { usleep(ms * 1000); }, 1);
+    for (int i=0; i<100; ++i) {
+        ep.trigger_callback("fast");
+    }
+    ep.trigger_callback("slow", 2);
+    ep.trigger_and_set("slow", 3);
+    usleep(100000);
+
+    auto snap = ep.metrics();
+    printf("%s\n", snap.to_json().c_str());
+    uint64_t tasks = 0;
+    for (auto& w : snap.workers) {
+        tasks += w.tasks;
+    }
+    for (auto& e : snap.events) {
+        const auto& s = e.second;
+        uint64_t expect = Metrics::enabled() ? (e.first == "fast" ? 100 : 2) : 0;
+        if (s.triggers != expect || s.runs != expect || s.queue_wait.count != expect)
+            return 1;
+        if (Metrics::enabled() && e.first == "slow" && s.run_time.percentile(0) < 1000000)
+            return 1;
+    }
+    if (tasks != (Metrics::enabled() ? 102 : 0))
+        return 1;
+
+    // triggers after terminate are counted as drops
+    ep.terminate();
+    ep.trigger_callback("fast");
+    for (auto& e : ep.metrics().events) {
+        if (e.first == "fast" && e.second.drops != (Metrics::enabled() ? 1 : 0))
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,66 @@
+//
+// Created by zelin on 2022/7/20.
+//
+#include "event_pool.h"
+#include "registry.h"
+#include "check.h"
+
+#include <unistd.h>
+
+int main() {
+    int failed = 0;
+    {
+        CompactRegistry reg;
+        std::atomic<uint64_t> sum{0};
+        int h = reg.add_handler<uint32_t, double>("sum", [&sum](uint32_t id, double w) {
+            sum += id * static_cast<uint64_t>(w);
+        });
+        int ping = reg.add_handler<>("ping", []() {});
+        const uint32_t n = 100000;
+        for (uint32_t i=0; i<n; ++i) {
+            if (reg.add("entity." + std::to_string(i), h, i, 2.0))
+                return 1;
+        }
+        failed += check(reg.size() == n, "add");
+        failed += check(reg.add("entity.7", h, 7u, 1.0) == -1, "taken");
+        failed += check(reg.add("x", h, 1, 1.0) == -1, "wrong args");
+        failed += check(reg.add("x", 5) == -1 && reg.add("ping", ping) == 0, "handler");
+
+        uint32_t slot = Metrics::NO_SLOT;
+        auto hp = reg.make_handle("entity.1234", slot);
+        failed += check(hp != nullptr && slot != Metrics::NO_SLOT, "lookup");
+        hp->run();
+        failed += check(sum == 2468, "args");
+
+        for (uint32_t i=0; i<n; i+=2) {
+            reg.remove("entity." + std::to_string(i));
+        }
+        failed += check(reg.size() == n / 2 + 1 && !reg.contains("entity.0") &&
+                        reg.contains("entity.1") && reg.remove("entity.0") == -1, "remove");
+        // reuses the tombstones and the freed args
+        for (uint32_t i=0; i<n; i+=2) {
+            reg.add("entity." + std::to_string(i), h, i, 3.0);
+        }
+        sum = 0;
+        reg.make_handle("entity.10", slot)->run();
+        reg.make_handle("entity.11", slot)->run();
+        failed += check(sum == 30 + 22 && reg.size() == n + 1, "add again");
+        printf("%zu bytes for %zu events\n", reg.memory(), reg.size());
+    }
+    {
+        event_pool ep(2);
+        std::atomic_int got{0};
+        int h = ep.compact_registry().add_handler<int>("set", [&got](int v) { got = v; });
+        ep.compact_registry().add("sensor.1", h, 42);
+        failed += check(ep.trigger_compact("sensor.2") == EP_NOT_FOUND, "trigger miss");
+        failed += check(ep.trigger_compact("sensor.1") == 0, "trigger");
+        usleep(20000);
+        failed += check(got == 42, "ran");
+        bool listed = false;
+        for (auto& e : ep.metrics().events) {
+            listed |= e.first == "compact:set" && (!Metrics::enabled() || e.second.runs == 1);
+        }
+        failed += check(listed, "metrics per handler");
+    }
+    return failed;
+}
@@ -0,0 +1,104 @@
+//
+// Created by zelin on 2022/7/22.
+//
+#include "event_pool.h"
+#include "triggerlog.h"
+#include "check.h"
+
+#include <unistd.h>
+
+using namespace std::chrono;
+
+struct counts {
+    std::atomic_int ticks{0}, sum{0}, pubs{0}, compact{0};
+};
+
+static void setup(event_pool& ep, counts& c) {
+    ep.register_callback("tick", [&c]() { ++c.ticks; });
+    ep.register_callback("add", [&c](int v, char) { c.sum += v; }, 1, 'x');
+    ep.register_callback("name", [](std::string) {}, std::string());
+    ep.subscribe("sensor.*", [&c](int v) { c.pubs += v; }, 0);
+    int h = ep.compact_registry().add_handler<int>("inc", [&c](int v) { c.compact += v; });
+    ep.compact_registry().add("e.1", h, 3);
+}
+
+int main() {
+    int failed = 0;
+    char path[] = "/tmp/unireplay.XXXXXX";
+    int fd = mkstemp(path);
+    close(fd);
+    {
+        counts c;
+        event_pool ep(2);
+        setup(ep, c);
+        failed += check(ep.record(path, 1 << 20) == 0, "record");
+        failed += check(ep.record(path, 1 << 20) == -1, "one at a time");
+        ep.trigger_callback("tick");
+        usleep(20000);
+        ep.trigger_callback("add");                 // with the registered 1
+        ep.trigger_callback("add", 10, 'y');
+        ep.trigger_and_set("add", 100, 'z');
+        ep.trigger_callback("name", std::string("left out"));
+        ep.publish("sensor.a", 5);
+        ep.trigger_compact("e.1");
+        ep.trigger_callback("missing");
+        failed += check(ep.stop_recording() == 1, "not packable left out");
+        ep.trigger_callback("tick");                // not recorded
+    }
+
+    {
+        TriggerLog log(path);
+        std::vector<std::string> ids;
+        uint64_t first = 0, last = 0;
+        size_t n = log.for_each([&](const TriggerLog::record_t& r) {
+            ids.emplace_back(r.id, r.id_len);
+            if (ids.size() == 1)
+                first = r.time_ns;
+            last = r.time_ns;
+        });
+        failed += check(n == 7 && ids[0] == "tick" && ids[4] == "sensor.a" && ids[6] == "missing",
+                        "read back");
+        failed += check(last - first >= 20000000, "timestamps");
+    }
+
+    for (double speed : {1.0, 0.0}) {
+        counts c;
+        event_pool ep(2);
+        setup(ep, c);
+        auto start = steady_clock::now();
+        int64_t n = ep.replay(path, speed);
+        auto took = steady_clock::now() - start;
+        usleep(20000);
+        printf("speed %.0f: %lld in %lldus, ticks %d sum %d pubs %d compact %d\n", speed,
+               (long long) n, (long long) duration_cast<microseconds>(took).count(),
+               c.ticks.load(), c.sum.load(), c.pubs.load(), c.compact.load());
+        failed += check(n == 7 && c.ticks == 1 && c.sum == 111 && c.pubs == 5 && c.compact == 3,
+                        "replay");
+        failed += check(speed == 0 || took >= milliseconds(20), "original pace");
+    }
+    {
+        // a log that filled up keeps what fit, and replays it
+        counts c;
+        size_t dropped;
+        {
+            event_pool ep(1);
+            setup(ep, c);
+            ep.record(path, 1024);
+            for (int i=0; i<200; ++i) {
+                ep.trigger_callback("tick");
+            }
+            dropped = ep.stop_recording();
+        }
+        size_t kept = TriggerLog(path).for_each([](const TriggerLog::record_t&) {});
+        counts r;
+        event_pool ep(1);
+        setup(ep, r);
+        int64_t n = ep.replay(path, 0);
+        ep.shutdown(shutdown_mode::drain);
+        failed += check(dropped > 0 && kept > 0 && kept + dropped == 200 &&
+                        n == int64_t(kept) && r.ticks == int(kept), "replay a full log");
+    }
+    failed += check(event_pool().replay("/nonexistent/log") == -1, "no log");
+    unlink(path);
+    return failed;
+}
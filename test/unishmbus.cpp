@@ -0,0 +1,116 @@
+//
+// Created by zelin on 2022/6/2.
+//
+#include "event_pool.h"
+#include "shm_bus.h"
+
+#include <cstring>
+#include <string>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+struct point {
+    int x;
+    double y;
+};
+
+int main() {
+    const int N = 10000;
+    std::string name = "/unishmbus." + std::to_string(getpid());
+    ShmBus bus(name, ShmBus::create, 1024);
+
+    const uint32_t first_slot = Metrics::new_slot();
+    std::atomic_int sum{0};
+    std::atomic_int points{0};
+    std::atomic_int empties{0};
+    {
+        event_pool ep(2);
+        ep.register_callback("add", [&sum](int a) { sum += a; }, 0);
+        ep.register_callback("point", [&points](point p, char c) {
+            if (p.x == 7 && p.y == 0.5 && c == 'c')
+                ++points;
+        }, point{}, char{});
+        ep.register_callback("empty", [&empties]() { ++empties; });
+        ep.attach(bus);
+
+        pid_t pid = fork();
+        if (pid == 0) {
+            ShmBus sender(name);
+            for (int i=1; i<=N; ++i) {
+                while (sender.publish("add", i) != 0) {
+                    usleep(10);     // ring full
+                }
+            }
+            while (sender.publish("point", point{7, 0.5}, 'c') != 0) {}
+            while (sender.publish("empty") != 0) {}
+            while (sender.publish("unregistered", 1) != 0) {}
+            _exit(0);
+        }
+        int status = 0;
+        waitpid(pid, &status, 0);
+
+        for (int i=0; i<200 && (sum != N * (N + 1) / 2 || !points || !empties); ++i) {
+            usleep(10000);
+        }
+    }
+    // the slots are numbered in order: the messages took none
+    if (Metrics::new_slot() - first_slot > 10)
+        return 1;
+
+    printf("sum %d points %d empties %d\n", sum.load(), points.load(), empties.load());
+    if (sum != N * (N + 1) / 2 || points != 1 || empties != 1)
+        return 1;
+
+    // detach closed only this end: it refuses to publish until reopened,
+    // another end in the same process is not affected
+    ShmBus other(name);
+    if (bus.publish("add", 1) != -1 || other.publish("add", 1) != 0)
+        return 1;
+    bus.reopen();
+    other.close();
+    if (bus.publish("add", 2) != 0)
+        return 1;
+    int got = 0;
+    while (bus.try_consume([&got](const char* id, size_t len, const void* p, size_t) {
+        if (std::string(id, len) != "add")
+            return;     // "unregistered" may still be left from above
+        int v;
+        memcpy(&v, p, sizeof(v));
+        got += v;
+    })) {}
+    if (got != 3)
+        return 1;
+
+    // slots whose lengths would not fit their 16 bit fields are refused
+    try {
+        ShmBus(name + ".big", ShmBus::create, 16, ShmBus::MAX_SLOT_SIZE + 8);
+        return 1;
+    } catch (const std::invalid_argument&) {}
+
+    // a payload that does not fit in a slot is refused
+    struct blob { char b[256]; } b{};
+    if (bus.publish("big", b) != -1)
+        return 1;
+
+    // lengths that don't fit their slot are never handed out
+    if (bus.publish("evil", 1) != 0 || bus.publish("good", 2) != 0)
+        return 1;
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    struct stat st{};
+    fstat(fd, &st);
+    auto mem = static_cast<char*>(mmap(nullptr, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    close(fd);
+    char* evil = static_cast<char*>(memmem(mem, st.st_size, "evil", 4));
+    uint16_t huge = 60000;
+    memcpy(evil - 8, &huge, sizeof(huge));      // its id_len, see ShmBus::slot
+    munmap(mem, st.st_size);
+    std::string ids;
+    while (bus.try_consume([&ids](const char* id, size_t len, const void*, size_t) {
+        ids.append(id, len);
+    })) {}
+    printf("after a corrupt slot: %s\n", ids.c_str());
+    return ids == "good" ? 0 : 1;
+}
@@ -0,0 +1,119 @@
+//
+// Created by zelin on 2022/6/24.
+//
+#include "event_pool.h"
+#include "threadpool.h"
+#include "check.h"
+
+#include <unistd.h>
+
+using namespace std::chrono;
+
+int main() {
+    int failed = 0;
+    {
+        std::atomic_int ran{0};
+        ThreadPool tp(1);
+        for (int i=0; i<10; ++i) {
+            tp.add_task([&ran]() { usleep(2000); ++ran; });
+        }
+        size_t dropped = tp.shutdown(shutdown_mode::drain);
+        failed += check(dropped == 0 && ran == 10, "drain runs everything");
+        failed += check(tp.add_task([]() {}) == EP_SHUTDOWN, "no task after shutdown");
+        failed += check(tp.shutdown(shutdown_mode::drain) == 0, "second shutdown");
+    }
+    {
+        std::atomic_int ran{0};
+        ThreadPool tp(1);
+        for (int i=0; i<20; ++i) {
+            tp.add_task([&ran]() { usleep(10000); ++ran; });
+        }
+        auto start = steady_clock::now();
+        size_t dropped = tp.shutdown(shutdown_mode::deadline, milliseconds(35));
+        auto took = duration_cast<milliseconds>(steady_clock::now() - start).count();
+        printf("deadline: ran %d dropped %zu in %lld ms\n", ran.load(), dropped, (long long) took);
+        failed += check(dropped > 0 && ran + dropped == 20 && took < 35 + 10 + 50,
+                        "deadline drops the rest");
+    }
+    {
+        std::atomic_int ran{0};
+        ThreadPool tp(2);
+        for (int i=0; i<10; ++i) {
+            tp.add_task([&ran]() { usleep(10000); ++ran; });
+        }
+        usleep(1000);
+        size_t dropped = tp.shutdown(shutdown_mode::immediate);
+        failed += check(dropped >= 6 && ran + dropped == 10, "immediate drops the queued");
+    }
+    {
+        std::atomic_int ran{0};
+        event_pool ep(1);
+        ep.register_callback("a", [&ran]() { usleep(1000); ++ran; });
+        for (int i=0; i<5; ++i) {
+            ep.trigger_callback("a");
+        }
+        failed += check(ep.shutdown(shutdown_mode::drain) == 0 && ran == 5, "event_pool drain");
+        failed += check(ep.trigger_callback("a") == EP_SHUTDOWN, "trigger after shutdown");
+        failed += check(ep.trigger_callback("b") == EP_NOT_FOUND, "unknown id");
+    }
+    {
+        // a handler stops its own pool: drain still runs what is queued
+        // behind it, its worker is joined by the destructor
+        std::atomic_int ran{0};
+        std::atomic_bool started{false}, go{false}, stopped{false};
+        std::atomic<size_t> dropped{SIZE_MAX};
+        {
+            ThreadPool tp(1);
+            tp.add_task([&]() {
+                started = true;
+                while (!go) usleep(100);
+                dropped = tp.shutdown(shutdown_mode::drain);
+                stopped = true;
+                ++ran;
+            });
+            for (int i=0; !started && i<2000; ++i) usleep(1000);
+            for (int i=0; i<9; ++i) {   // queued behind the running handler
+                tp.add_task([&ran]() { ++ran; });
+            }
+            go = true;
+            for (int i=0; !stopped && i<2000; ++i) usleep(1000);
+            failed += check(stopped && tp.add_task([]() {}) == EP_SHUTDOWN, "shutdown from a handler");
+        }
+        failed += check(ran == 10 && dropped == 0, "drain from a handler");
+
+        // immediate leaves them, the next shutdown() counts them
+        ran = 0;
+        started = false;
+        go = false;
+        stopped = false;
+        {
+            ThreadPool tp(1);
+            tp.add_task([&]() {
+                started = true;
+                while (!go) usleep(100);
+                dropped = tp.shutdown(shutdown_mode::immediate);
+                stopped = true;
+                ++ran;
+            });
+            for (int i=0; !started && i<2000; ++i) usleep(1000);
+            for (int i=0; i<9; ++i) {   // queued behind the running handler
+                tp.add_task([&ran]() { ++ran; });
+            }
+            go = true;
+            for (int i=0; !stopped && i<2000; ++i) usleep(1000);
+            size_t left = tp.shutdown(shutdown_mode::drain);
+            failed += check(ran == 1 && dropped == 0 && left == 9, "immediate from a handler");
+        }
+
+        event_pool ep(2);
+        ep.register_callback("stop", [&ep, &stopped]() {
+            ep.terminate();
+            stopped = false;
+        });
+        ep.trigger_callback("stop");
+        for (int i=0; stopped && i<2000; ++i) usleep(1000);
+        failed += check(!stopped && ep.trigger_callback("stop") == EP_SHUTDOWN,
+                        "terminate from a handler");
+    }
+    return failed;
+}
@@ -0,0 +1,97 @@
+//
+// Created by zelin on 2022/7/25.
+//
+#include "event_pool.h"
+#include "threadpool.h"
+#include "check.h"
+
+#include <algorithm>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std::chrono;
+
+/// burn \p d of this thread's cpu time, however long that takes
+static void spin(const milliseconds d) {
+    timespec ts{};
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    const int64_t until = ts.tv_sec * 1000000000LL + ts.tv_nsec + nanoseconds(d).count();
+    do {
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    } while (ts.tv_sec * 1000000000LL + ts.tv_nsec < until);
+}
+
+int main() {
+    int failed = 0;
+    {
+        // a stuck worker's queue moves to the other one
+        ThreadPool tp(2);
+        std::mutex lk;
+        std::vector<std::pair<size_t, uint64_t>> flagged;
+        tp.watch(milliseconds(50), [&](size_t worker, uint32_t, uint64_t ns) {
+            std::lock_guard<std::mutex> lg(lk);
+            flagged.emplace_back(worker, ns);
+        });
+        auto t0 = steady_clock::now();
+        tp.add_task([]() { usleep(400000); });     // worker 0
+        usleep(5000);
+        tp.add_task([]() { usleep(20000); });      // worker 1, under the threshold
+        usleep(5000);
+        std::atomic_int quick{0};
+        std::atomic<int64_t> last_ms{0};
+        for (int i=0; i<10; ++i) {
+            tp.add_task([&]() {
+                ++quick;
+                last_ms = duration_cast<milliseconds>(steady_clock::now() - t0).count();
+            });
+        }
+        while (quick < 10 && steady_clock::now() - t0 < seconds(2)) {
+            usleep(1000);
+        }
+        failed += check(quick == 10 && last_ms < 300, "queue moved off the stuck worker");
+        {
+            std::lock_guard<std::mutex> lg(lk);
+            failed += check(flagged.size() == 1 && flagged[0].first == 0 &&
+                            flagged[0].second >= 50000000, "flagged once while running");
+        }
+        failed += check(tp.stats()[0].moved > 0, "moved counted");
+        tp.shutdown(shutdown_mode::drain);
+    }
+    {
+        event_pool ep(2);
+        ep.measure_cpu(true);
+        std::mutex lk;
+        std::vector<std::string> slow;
+        ep.watch_slow(milliseconds(50), [&](const std::string& id, nanoseconds) {
+            std::lock_guard<std::mutex> lg(lk);
+            slow.push_back(id);
+        });
+        ep.register_callback("spin", []() { spin(milliseconds(20)); });
+        ep.register_callback("sleep", []() { usleep(20000); });
+        ep.register_callback("stuck", []() { usleep(150000); });
+        for (int i=0; i<3; ++i) {
+            ep.trigger_callback("spin");
+            ep.trigger_callback("sleep");
+        }
+        ep.trigger_callback("stuck");
+        ep.shutdown(shutdown_mode::drain);
+        {
+            std::lock_guard<std::mutex> lg(lk);
+            // on a loaded machine a spinning one may go over too
+            failed += check(std::count(slow.begin(), slow.end(), "stuck") == 1, "slow handler named");
+        }
+        if (Metrics::enabled()) {
+            for (auto& e : ep.metrics().events) {
+                if (e.first == "spin")
+                    failed += check(e.second.cpu_time.count == 3 &&
+                                    e.second.cpu_time.mean() > 15e6, "spinning handler uses cpu");
+                else if (e.first == "sleep")
+                    failed += check(e.second.cpu_time.mean() < 5e6 &&
+                                    e.second.run_time.mean() > 15e6, "sleeping handler does not");
+                else if (e.first == "stuck")
+                    failed += check(e.second.slow == 1, "slow counted");
+            }
+        }
+    }
+    return failed;
+}
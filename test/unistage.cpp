@@ -0,0 +1,98 @@
+//
+// Created by zelin on 2022/7/18.
+//
+#include "event_pool.h"
+#include "threadpool.h"
+#include "check.h"
+
+#include <sys/resource.h>
+#include <unistd.h>
+
+static void wait_for(const std::atomic_int& v, const int n) {
+    for (int i=0; v < n && i<2000; ++i) {
+        usleep(1000);
+    }
+}
+
+int main() {
+    int failed = 0;
+    {
+        event_pool ep(2);
+        std::atomic_int ran{0};
+        ep.register_callback("tick", [&ran]() { ++ran; });
+        ep.stage_this_thread(10, std::chrono::seconds(10));
+        for (int i=0; i<25; ++i) {
+            ep.trigger_callback("tick");
+        }
+        wait_for(ran, 20);
+        failed += check(ran == 20, "full stages go out");
+        ep.flush();
+        wait_for(ran, 25);
+        failed += check(ran == 25, "flush");
+
+        // the time bound, from the flusher thread
+        ep.stage_this_thread(100, std::chrono::milliseconds(5));
+        for (int i=0; i<3; ++i) {
+            ep.trigger_callback("tick");
+        }
+        wait_for(ran, 28);
+        failed += check(ran == 28, "max delay");
+
+        // other threads are not staged, and a thread's stage goes out when it exits
+        std::thread([&ep]() { ep.trigger_callback("tick"); }).join();
+        std::thread([&ep]() {
+            ep.stage_this_thread(100, std::chrono::seconds(10));
+            ep.trigger_callback("tick");
+        }).join();
+        wait_for(ran, 30);
+        failed += check(ran == 30, "thread exit");
+
+        ep.stage_this_thread(0);
+        ep.trigger_callback("tick");
+        wait_for(ran, 31);
+        failed += check(ran == 31, "off again");
+    }
+    {
+        // the flusher sleeps while nothing is staged, and wakes for a stage
+        // due before the one it waits for
+        event_pool ep(1);
+        std::atomic_int ran{0};
+        ep.register_callback("tick", [&ran]() { ++ran; });
+        ep.stage_this_thread(100, std::chrono::seconds(10));
+        ep.trigger_callback("tick");
+        bool early = false;
+        std::thread([&]() {
+            ep.stage_this_thread(100, std::chrono::milliseconds(1));
+            ep.trigger_callback("tick");
+            wait_for(ran, 1);
+            early = ran == 1;   // before turning staging off pushes it
+            ep.stage_this_thread(0);
+        }).join();
+        failed += check(early && ran == 1, "shorter delay");
+        ep.stage_this_thread(100, std::chrono::milliseconds(5));
+        wait_for(ran, 2);
+        failed += check(ran == 2, "restaged");
+
+        rusage before{}, after{};
+        getrusage(RUSAGE_SELF, &before);
+        usleep(100000);
+        getrusage(RUSAGE_SELF, &after);
+        failed += check(after.ru_nvcsw - before.ru_nvcsw < 10, "idle flusher");
+        ep.trigger_callback("tick");
+        wait_for(ran, 3);
+        failed += check(ran == 3, "max delay after idle");
+    }
+    {
+        // drain runs what was staged
+        std::atomic_int ran{0};
+        ThreadPool tp(1);
+        tp.stage_this_thread(100, std::chrono::seconds(10));
+        for (int i=0; i<5; ++i) {
+            tp.add_task([&ran]() { ++ran; });
+        }
+        size_t dropped = tp.shutdown(shutdown_mode::drain);
+        failed += check(ran == 5 && dropped == 0, "drain");
+        failed += check(tp.add_task([]() {}) == EP_SHUTDOWN, "staged after shutdown");
+    }
+    return failed;
+}
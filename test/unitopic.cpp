@@ -0,0 +1,62 @@
+//
+// Created by zelin on 2022/7/4.
+//
+#include "event_pool.h"
+#include "topic.h"
+
+#include <algorithm>
+#include <unistd.h>
+
+static std::vector<uint64_t> match(const TopicTrie& t, const std::string& topic) {
+    std::vector<uint64_t> out;
+    t.match(topic, out);
+    return out;
+}
+
+int main() {
+    TopicTrie t;
+    t.add("sensor.*.temperature", 0);
+    t.add("sensor.#", 1);
+    t.add("sensor.kitchen.temperature", 2);
+    t.add("#", 3);
+    t.add("*.*", 4);
+    t.add("sensor.#.max", 5);
+    if (t.add("sensor..x", 6) || t.add("", 6))
+        return 1;
+
+    if (match(t, "sensor.kitchen.temperature") != std::vector<uint64_t>{0, 1, 2, 3})
+        return 1;
+    if (match(t, "sensor") != std::vector<uint64_t>{1, 3})
+        return 1;
+    if (match(t, "sensor.max") != std::vector<uint64_t>{1, 3, 4, 5})
+        return 1;
+    if (match(t, "sensor.a.b.c.max") != std::vector<uint64_t>{1, 3, 5})
+        return 1;
+    if (match(t, "light.on") != std::vector<uint64_t>{3, 4})
+        return 1;
+    t.remove("#", 3);
+    t.remove("sensor.#", 1);
+    if (match(t, "sensor.kitchen.temperature") != std::vector<uint64_t>{0, 2})
+        return 1;
+
+    event_pool ep(2);
+    std::atomic_int temps{0}, all{0}, sum{0};
+    auto s1 = ep.subscribe("sensor.*.temperature", [&temps]() { ++temps; });
+    ep.subscribe("sensor.#", [&all]() { ++all; });
+    ep.subscribe("sensor.*.temperature", [&sum](int v) { sum += v; }, 0);
+    if (ep.subscribe("bad..pattern", []() {}) != -1)
+        return 1;
+
+    // without args the int one runs with its subscribed 0
+    if (ep.publish("sensor.kitchen.temperature") != 3)
+        return 1;
+    if (ep.publish("sensor.kitchen.temperature", 5) != 1)
+        return 1;
+    ep.publish("sensor.kitchen.humidity");
+    ep.publish("light.kitchen");
+    ep.unsubscribe(s1);
+    ep.publish("sensor.hall.temperature");
+    usleep(50000);
+    printf("temps %d all %d sum %d\n", temps.load(), all.load(), sum.load());
+    return temps == 1 && all == 3 && sum == 5 ? 0 : 1;
+}
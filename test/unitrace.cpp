@@ -0,0 +1,59 @@
+//
+// Created by zelin on 2022/6/14.
+//
+#include "event_pool.h"
+#include "trace.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <unistd.h>
+
+static size_t count(const std::string& s, const std::string& what) {
+    size_t n = 0;
+    for (auto p = s.find(what); p != std::string::npos; p = s.find(what, p + 1)) {
+        ++n;
+    }
+    return n;
+}
+
+int main() {
+    std::string path = "unitrace." + std::to_string(getpid()) + ".json";
+    {
+        event_pool ep(2);
+        std::atomic_int ran{0};
+        ep.register_callback("a", [&ran]() { ++ran; });
+        ep.register_callback("b", [](int ms) { usleep(ms * 1000); }, 1);
+        ep.register_callback("q\"\n", []() {});
+
+        ep.trigger_callback("a");   // not traced yet
+        while (!ran) usleep(100);
+        Tracer::enable();
+        Tracer::dump_on_terminate(path);
+        for (int i=0; i<10; ++i) {
+            ep.trigger_callback("a");
+        }
+        ep.trigger_callback("b", 2);
+        ep.trigger_callback("q\"\n");
+        usleep(100000);
+    }
+    Tracer::disable();
+
+    std::ifstream in(path);
+    std::stringstream ss;
+    ss << in.rdbuf();
+    std::string json = ss.str();
+    unlink(path.c_str());
+
+    size_t runs_a = count(json, "\"name\":\"a\",\"cat\":\"run\"");
+    size_t runs_b = count(json, "\"name\":\"b\",\"cat\":\"run\"");
+    size_t triggers = count(json, "\"cat\":\"trigger\"");
+    size_t flows = count(json, "\"ph\":\"f\"");
+    size_t runs_q = count(json, "\"name\":\"q\\\"\\u000a\",\"cat\":\"run\"");
+    printf("runs a %zu b %zu q %zu, triggers %zu, flows %zu\n", runs_a, runs_b, runs_q, triggers,
+           flows);
+    if (json.rfind("{\"displayTimeUnit\"", 0) != 0 || runs_a != 10 || runs_b != 1 ||
+        runs_q != 1 || triggers != 12 || flows != 12)
+        return 1;
+    return 0;
+}
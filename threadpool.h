@@ -5,99 +5,882 @@
 #ifndef EVENT_MANAGER_THREADPOOL_H
 #define EVENT_MANAGER_THREADPOOL_H
 
+#include "cancel.h"
 #include "handle.h"
+#include "metrics.h"
 #include "sema.h"
+#include "trace.h"
 
+#include <algorithm>
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <exception>
+#include <functional>
 #include <memory>
+#include <mutex>
 #include <vector>
 #include <thread>
 #include <queue>
+#include <unordered_map>
+
+#include <time.h>
+
+/// a queued handle, with what the pool needs to know about it
+struct task_t {
+    handle_ptr_t handle;
+    uint32_t event = Metrics::NO_SLOT;  ///< metrics slot of the event it runs for
+    uint64_t enqueued_ns = 0;
+    uint64_t trace = 0;                 ///< Tracer task id, 0 if not traced
+    uint64_t deadline_ns = 0;           ///< metrics_now_ns() to start by, 0 for none
+    handle_ptr_t on_expire;             ///< runs instead of handle past the deadline
+    std::shared_ptr<cancel_state> cancel;   ///< of its cancel_token, if any
+    /// the task is dropped once *generation moved past generation_seen
+    std::shared_ptr<const std::atomic<uint32_t>> generation;
+    uint32_t generation_seen = 0;
+
+    /// \internal false if it was cancelled, either way, since it was queued.
+    /// once it returned true, the token can't cancel it any more
+    bool start() const {
+        if (generation && generation->load(std::memory_order_acquire) != generation_seen) {
+            if (cancel)
+                cancel->v.store(cancel_state::cancelled, std::memory_order_release);
+            return false;
+        }
+        int expected = cancel_state::pending;
+        return !cancel || cancel->v.compare_exchange_strong(expected, cancel_state::started,
+                                                            std::memory_order_acq_rel);
+    }
+};
+
+/// what the triggers return besides 0
+enum ep_errc : int {
+    EP_NOT_FOUND = -1,  ///< no such id, or the args don't match it
+    EP_SHUTDOWN  = -2,  ///< the pool is shutting down, nothing is accepted
+    EP_REJECTED  = -3,  ///< over the event's rate limit
+    EP_OPEN      = -4,  ///< the event failed too often, its circuit breaker is open
+};
+
+enum class shutdown_mode {
+    drain,      ///< run everything already queued
+    deadline,   ///< drain until the timeout, then drop what is left
+    immediate,  ///< drop everything queued, wait only for the running tasks
+};
 
 class ThreadPool {
 private:
-    std::atomic_bool quit_{false};
+    /// written by the worker only, but moved by the watchdog
+    struct alignas(64) worker_counters {
+        std::atomic<uint64_t> tasks{0};
+        std::atomic<uint64_t> busy_ns{0};
+        std::atomic<uint64_t> expired{0};
+        std::atomic<uint64_t> moved{0};
+        std::atomic<uint64_t> failed{0};
+        /// metrics_now_ns() the running handler started at, 0 when idle.
+        /// stored after event, so a watchdog reading it then event sees that run
+        std::atomic<uint64_t> since{0};
+        std::atomic<uint32_t> event{Metrics::NO_SLOT};
+    };
+
+    /// \internal the queue of one worker. the tasks with a deadline go first,
+    /// earliest deadline first, then the others in arrival order
+    struct lane {
+        std::vector<task_t> edf;    ///< heap on deadline_ns
+        std::queue<task_t> fifo;
+        /// taken by the worker and not done yet, written by the worker only
+        std::atomic<size_t> claimed{0};
+        /// the worker found the lane empty and waits on its semaphore, so the
+        /// next push has to wake it. the pushes meanwhile don't
+        bool sleeping = true;
+        /// the watchdog caught its worker in a slow handler, new tasks go
+        /// elsewhere until the worker takes its next batch
+        bool stuck = false;
+
+        /// counts the claimed tasks, so a busy worker is not taken as idle
+        size_t size() const {
+            return edf.size() + fifo.size() + claimed.load(std::memory_order_relaxed);
+        }
+
+        bool empty() const {
+            return edf.empty() && fifo.empty();
+        }
+
+        void push(task_t&& task) {
+            if (!task.deadline_ns) {
+                fifo.emplace(std::move(task));
+                return;
+            }
+            edf.emplace_back(std::move(task));
+            std::push_heap(edf.begin(), edf.end(), later);
+        }
+
+        bool pop(task_t& task) {
+            if (!edf.empty()) {
+                std::pop_heap(edf.begin(), edf.end(), later);
+                task = std::move(edf.back());
+                edf.pop_back();
+                return true;
+            }
+            if (fifo.empty())
+                return false;
+            task = std::move(fifo.front());
+            fifo.pop();
+            return true;
+        }
+
+        static bool later(const task_t& a, const task_t& b) {
+            return a.deadline_ns > b.deadline_ns;
+        }
+    };
+
+    enum state_t { running, draining, stopping };
+
+    /// most tasks a worker takes at once. it runs them before it looks at the
+    /// queue again, so a task with an earlier deadline may wait for them
+    static const size_t BATCH = 64;
+
+    std::atomic<int> state_{running};
+    /// false once shutdown starts, read under the queue locks
+    bool accepting_ = true;
     const size_t n_threads_;
     std::vector<Semaphore> sems_;
     std::vector<std::thread> threads_;
     /// \todo max task number for each queue
-    std::vector<std::queue<handle_ptr_t>> tasks_;
+    std::vector<lane> tasks_;
+    /// guards tasks_[i], tasks may be added from several threads at once
+    std::vector<std::mutex> lks_;
+    std::vector<worker_counters> counters_;
+
+    /// \internal the tasks one producer thread staged for this pool
+    struct stage {
+        std::mutex lk;
+        std::vector<task_t> tasks;
+        size_t capacity;
+        uint64_t max_delay_ns;
+        uint64_t first_ns = 0;      ///< when the oldest staged task came
+        /// null once the pool shut down or the thread left
+        std::atomic<ThreadPool*> pool;
+
+        stage(ThreadPool* pool, const size_t capacity, const uint64_t max_delay_ns) :
+                capacity(capacity),
+                max_delay_ns(max_delay_ns),
+                pool(pool) {
+            tasks.reserve(capacity);
+        }
+    };
+    using stage_ptr = std::shared_ptr<stage>;
+
+    /// \internal the stages of the calling thread, flushed when it exits
+    struct local_stages {
+        std::unordered_map<const ThreadPool*, stage_ptr> stages;
+        const ThreadPool* last = nullptr;
+        stage* last_stage = nullptr;
+
+        ~local_stages() {
+            for (auto& s : stages) {
+                ThreadPool::leave(*s.second);
+            }
+        }
+    };
+
+    std::atomic<size_t> n_staging_{0};     ///< threads staging, to skip the lookup
+    std::mutex stages_lk_;
+    std::vector<stage_ptr> stages_;
+    std::thread flusher_;
+    std::condition_variable flusher_cv_;
+    /// when the flusher wakes next, ns, UINT64_MAX while it waits for a stage_task()
+    std::atomic<uint64_t> flusher_wakes_{UINT64_MAX};
+    bool flusher_quit_ = false;             ///< under stages_lk_
+
+    std::atomic<bool> cpu_time_{false};     ///< see measure_cpu()
+    std::atomic<bool> watching_{false};     ///< a watchdog runs, see watch()
+    std::thread watchdog_;
+    std::mutex watch_lk_;
+    std::condition_variable watch_cv_;
+    uint64_t watch_ns_ = 0;                 ///< under watch_lk_, 0 to pause
+    bool move_queue_ = true;                ///< under watch_lk_
+    bool watch_quit_ = false;               ///< under watch_lk_
+    std::function<void(size_t, uint32_t, uint64_t)> on_slow_;   ///< under watch_lk_
+
+    using error_handler = std::function<void(uint32_t, std::exception_ptr)>;
+    std::shared_ptr<const error_handler> on_error_;     ///< std::atomic_load() it
+
+    std::mutex shutdown_lk_;   ///< one shutdown() at a time
+    bool joined_ = false;       ///< all the threads, see shutdown()
+    std::mutex live_lk_;
+    std::condition_variable exited_;
+    size_t live_ = 0;       ///< workers still running, under live_lk_
 public:
     explicit ThreadPool(const size_t n_threads = 6) :
         n_threads_(n_threads),
         sems_(n_threads),
-        threads_(n_threads),
-        tasks_(n_threads){
+        tasks_(n_threads),
+        lks_(n_threads),
+        counters_(n_threads) {
         poll_events();
     }
 
+    /// drains the queues, see shutdown()
     ~ThreadPool() {
-        terminate();
-        for (auto& thread : threads_) {
-            if (thread.joinable())
-                thread.join();
+        shutdown(shutdown_mode::drain);
+    }
+
+    size_t size() const {
+        return n_threads_;
+    }
+
+    /// busy time, tasks run and current queue depth of each worker
+    std::vector<worker_stats> stats() {
+        std::vector<worker_stats> ws(n_threads_);
+        for (size_t i=0; i<n_threads_; ++i) {
+            ws[i].tasks = counters_[i].tasks.load(std::memory_order_relaxed);
+            ws[i].busy_ns = counters_[i].busy_ns.load(std::memory_order_relaxed);
+            ws[i].expired = counters_[i].expired.load(std::memory_order_relaxed);
+            ws[i].moved = counters_[i].moved.load(std::memory_order_relaxed);
+            ws[i].failed = counters_[i].failed.load(std::memory_order_relaxed);
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            ws[i].queue_depth = tasks_[i].size();
         }
-        printf("ended\n");
+        return ws;
     }
 
-    /// \note if already terminated, it does nothing
+    /// \return 0, or EP_SHUTDOWN once shutdown started
     template<typename ...Args>
-    void add_task(type_identity_t<std::function<void(Args...)>> func, Args... args) {
-        if (quit_) {
-            return;
+    int add_task(type_identity_t<std::function<void(Args...)>> func, Args... args) {
+        if (state_ != running) {
+            return EP_SHUTDOWN;
         }
         auto hp = std::make_shared<handle<void(Args...)> >(func, args...);
-        add_task(hp);
+        return add_task(hp);
     }
 
-    /// \note if already terminated, it does nothing
-    void add_task(const handle_ptr_t& handle) {
-        if (quit_)
+    /// \param event the metrics slot to account the task to
+    /// \param deadline_ns if not 0, the metrics_now_ns() the task has to start
+    /// by. such tasks run before the others of the worker, earliest deadline
+    /// first, and are skipped once late, \p on_expire runs then instead if
+    /// given. a steady stream of them delays the tasks without a deadline
+    /// \return 0, or EP_SHUTDOWN once shutdown started
+    int add_task(const handle_ptr_t& handle, const uint32_t event = Metrics::NO_SLOT,
+                 const uint64_t deadline_ns = 0, handle_ptr_t on_expire = nullptr) {
+        if (state_ != running) {
+            Metrics::on_drop(event);
+            return EP_SHUTDOWN;
+        }
+        task_t task{handle, event};
+        task.deadline_ns = deadline_ns;
+        task.on_expire = std::move(on_expire);
+        return submit(std::move(task));
+    }
+
+    /// queue \p task as the caller filled it in, see task_t and add_task()
+    /// \return 0, or EP_SHUTDOWN once shutdown started
+    int submit(task_t task) {
+        if (state_ != running) {
+            Metrics::on_drop(task.event);
+            return EP_SHUTDOWN;
+        }
+#if EVENT_MANAGER_METRICS
+        task.enqueued_ns = metrics_now_ns();
+#endif
+        task.trace = Tracer::new_task();
+        if (n_staging_.load(std::memory_order_relaxed)) {
+            if (stage* st = my_stage())
+                return stage_task(*st, std::move(task));
+        }
+        return push(least_loaded(), std::move(task));
+    }
+
+    /// stage the tasks the calling thread adds from now on, instead of
+    /// queueing each at once: they go to a worker together once \p capacity
+    /// are staged, on flush(), or when the oldest is \p max_delay old. fewer queue locks
+    /// and wakeups for a thread adding many tasks, for that bounded latency.
+    /// staged tasks count as accepted, if the pool shuts down before they are
+    /// queued they are dropped as if queued. a zero \p capacity turns it off
+    void stage_this_thread(const size_t capacity = BATCH,
+                           const std::chrono::microseconds max_delay = std::chrono::microseconds(100)) {
+        auto& l = locals();
+        auto it = l.stages.find(this);
+        if (it != l.stages.end()) {
+            leave(*it->second);
+            l.stages.erase(it);
+        }
+        l.last = nullptr;
+        if (!capacity || state_ != running)
             return;
-        int min_tasks = INT32_MAX;  // the minimum tasks in queue of all threads
-        int min_i     = -1;
-        for (int i=0; i<n_threads_; ++i) {
-            if (tasks_[i].empty()) {
-                tasks_[i].emplace(handle);
-                sems_[i].release();
-                min_i = -1; // clear this to original value
-                break;
-            } else {
-                if (tasks_[i].size() < min_tasks) {
-                    min_tasks = tasks_[i].size();
-                    min_i = i;
-                }
+        uint64_t delay = std::max<uint64_t>(1000, std::chrono::nanoseconds(max_delay).count());
+        auto st = std::make_shared<stage>(this, capacity, delay);
+        l.stages.emplace(this, st);
+        n_staging_.fetch_add(1, std::memory_order_relaxed);
+
+        std::lock_guard<std::mutex> lg(stages_lk_);
+        stages_.push_back(st);
+        if (!flusher_.joinable())
+            flusher_ = std::thread([this]() { flush_stages(); });
+    }
+
+    /// a handler that throws costs only its own run: the worker catches it,
+    /// counts it in event_stats::failed and passes it to
+    /// \p on_error(metrics slot, exception), on that worker. nullptr just counts.
+    /// whatever \p on_error throws is dropped
+    void on_error(std::function<void(uint32_t, std::exception_ptr)> on_error) {
+        std::shared_ptr<const error_handler> f;
+        if (on_error)
+            f = std::make_shared<const error_handler>(std::move(on_error));
+        std::atomic_store(&on_error_, std::move(f));
+    }
+
+    /// also measure the thread cpu time of every handler run, into
+    /// event_stats::cpu_time. two clock_gettime() calls more per task, and
+    /// next to run_time it tells a handler burning cpu from one that blocks
+    void measure_cpu(const bool on) {
+        cpu_time_.store(on, std::memory_order_relaxed);
+    }
+
+    /// start a watchdog thread that checks every \p threshold / 2 for
+    /// handlers running longer than \p threshold. each such run is flagged
+    /// once: counted in event_stats::slow and passed to
+    /// \p on_slow(worker, metrics slot, ns running so far), on the watchdog
+    /// thread, which must not call watch() from it. with \p move_queue, the
+    /// tasks queued behind it go to the other workers, and new ones avoid it
+    /// until it is done. the rest of the batch it is running can't be moved,
+    /// see BATCH. it keeps flagging through a drain, but moves nothing once
+    /// shutdown started. calling it again changes the settings, a zero
+    /// \p threshold pauses it
+    void watch(const std::chrono::microseconds threshold,
+               std::function<void(size_t, uint32_t, uint64_t)> on_slow = nullptr,
+               const bool move_queue = true) {
+        std::lock_guard<std::mutex> lg(watch_lk_);
+        if (watch_quit_)
+            return;
+        watch_ns_ = std::chrono::nanoseconds(threshold).count();
+        on_slow_ = std::move(on_slow);
+        move_queue_ = move_queue;
+        watching_.store(watch_ns_ != 0, std::memory_order_relaxed);
+        if (!watchdog_.joinable())
+            watchdog_ = std::thread([this]() { watchdog(); });
+        watch_cv_.notify_one();
+    }
+
+    /// queue what the calling thread staged, see stage_this_thread()
+    void flush() {
+        if (stage* st = my_stage())
+            flush_stage(*st, true, 0);
+    }
+
+    /// stop accepting tasks (add_task() returns EP_SHUTDOWN from now on) and
+    /// stop the workers, as \p mode says.
+    /// a running task is never interrupted, so with shutdown_mode::deadline
+    /// this may return later than \p timeout by the longest handler.
+    /// calling it again just returns 0.
+    /// a handler may call it too: its own worker can't be joined then. that
+    /// worker goes on as \p mode says once the handler returns, with the
+    /// tasks of its own queue, and the destructor (or the next shutdown())
+    /// joins it and counts what it left. if a shutdown is already under way
+    /// there, this returns 0 at once
+    /// \return the number of queued tasks that were dropped without running
+    size_t shutdown(const shutdown_mode mode,
+                    const std::chrono::milliseconds timeout = std::chrono::milliseconds(0)) {
+        const size_t self = worker_of_this_thread();
+        std::unique_lock<std::mutex> lg(shutdown_lk_, std::defer_lock);
+        if (self == n_threads_) {
+            lg.lock();
+        } else if (!lg.try_lock()) {
+            return 0;   // the shutdown under way joins this worker
+        }
+        if (joined_)
+            return 0;
+        flush_all();
+        // once every queue lock has been taken, no add_task() is half way in
+        for (size_t i=0; i<n_threads_; ++i) {
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            accepting_ = false;
+        }
+
+        if (mode == shutdown_mode::immediate || state_ == stopping) {
+            state_ = stopping;
+        } else {
+            state_ = draining;
+        }
+        wake_all();
+        if (mode == shutdown_mode::deadline) {
+            const size_t left = self < n_threads_ ? 1 : 0;  // the caller's own worker
+            std::unique_lock<std::mutex> lk(live_lk_);
+            if (!exited_.wait_for(lk, timeout, [this, left]() { return live_ == left; })) {
+                state_ = stopping;
+                wake_all();
             }
         }
+        for (size_t i=0; i<n_threads_; ++i) {
+            if (i != self && threads_[i].joinable())
+                threads_[i].join();
+        }
 
-        // no empty task queue, add to the queue with the least tasks
-        if (min_i != -1) {
-            tasks_[min_i].emplace(handle);
-            sems_[min_i].release();
+        size_t dropped = 0;
+        for (size_t i=0; i<n_threads_; ++i) {
+            if (i == self)
+                continue;   // still running, it drains or leaves its own queue
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            task_t task;
+            while (tasks_[i].pop(task)) {
+                Metrics::on_drop(task.event);
+                ++dropped;
+            }
         }
+        dropped += close_stages();
+        if (flusher_.joinable())
+            flusher_.join();
+        stop_watchdog();
+        joined_ = self == n_threads_;
+        return dropped;
     }
 
+    /// shutdown(shutdown_mode::immediate)
     void terminate() {
-        quit_ = true;
+        shutdown(shutdown_mode::immediate);
+    }
+
+private:
+    /// \internal the pool and index of the worker on the calling thread
+    struct worker_id {
+        const ThreadPool* pool = nullptr;
+        size_t index = 0;
+    };
+
+    static worker_id& this_worker() {
+        static thread_local worker_id w;
+        return w;
+    }
+
+    /// \internal the index of the calling thread's worker, n_threads_ if it
+    /// is not one of this pool
+    size_t worker_of_this_thread() const {
+        const worker_id& w = this_worker();
+        return w.pool == this ? w.index : n_threads_;
+    }
+
+    /// \internal the queue with the least tasks, skipping the stuck ones
+    /// unless all are
+    size_t least_loaded() {
+        size_t min_tasks = SIZE_MAX;  // the minimum tasks in queue of all threads
+        size_t min_i     = 0;
+        size_t stuck_i   = SIZE_MAX;
+        for (size_t i=0; i<n_threads_; ++i) {
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            if (tasks_[i].stuck) {
+                stuck_i = i;
+                continue;
+            }
+            if (tasks_[i].size() < min_tasks) {
+                min_tasks = tasks_[i].size();
+                min_i = i;
+                if (!min_tasks)
+                    break;  // take the first empty queue
+            }
+        }
+        return min_tasks == SIZE_MAX && stuck_i != SIZE_MAX ? stuck_i : min_i;
+    }
+
+    /// \internal
+    int push(const size_t i, task_t&& task) {
+        const uint64_t trace = task.trace;
+        const uint32_t event = task.event;
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            if (!accepting_) {
+                Metrics::on_drop(event);
+                return EP_SHUTDOWN;
+            }
+            tasks_[i].push(std::move(task));
+            wake = tasks_[i].sleeping;
+            tasks_[i].sleeping = false;
+        }
+        Tracer::record_event(Tracer::enqueue, trace, event, i);
+        if (wake)
+            sems_[i].release();
+        return 0;
+    }
+
+    /// \internal queue all of \p batch to worker \p i under one lock
+    int push_batch(const size_t i, std::vector<task_t>& batch) {
+        bool wake;
+        {
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            if (!accepting_) {
+                for (auto& task : batch) {
+                    Metrics::on_drop(task.event);
+                }
+                batch.clear();
+                return EP_SHUTDOWN;
+            }
+            for (auto& task : batch) {
+                tasks_[i].push(std::move(task));
+            }
+            wake = tasks_[i].sleeping;
+            tasks_[i].sleeping = false;
+        }
+        if (Tracer::on()) {
+            for (auto& task : batch) {
+                Tracer::record_event(Tracer::enqueue, task.trace, task.event, i);
+            }
+        }
+        batch.clear();
+        if (wake)
+            sems_[i].release();
+        return 0;
+    }
+
+    static local_stages& locals() {
+        static thread_local local_stages l;
+        return l;
+    }
+
+    /// \internal the calling thread's stage for this pool, null if it has none
+    stage* my_stage() {
+        auto& l = locals();
+        if (l.last != this) {
+            auto it = l.stages.find(this);
+            l.last = this;
+            l.last_stage = it == l.stages.end() ? nullptr : it->second.get();
+        }
+        stage* st = l.last_stage;
+        return st && st->pool.load(std::memory_order_relaxed) == this ? st : nullptr;
+    }
+
+    int stage_task(stage& st, task_t&& task) {
+        uint64_t due;
+        {
+            std::lock_guard<std::mutex> lg(st.lk);
+            const bool first = st.tasks.empty();
+            if (first)
+                st.first_ns = metrics_now_ns();
+            st.tasks.emplace_back(std::move(task));
+            if (st.tasks.size() >= st.capacity)
+                return push_staged(st);
+            if (!first)
+                return 0;
+            due = st.first_ns + st.max_delay_ns;
+        }
+        // the first one staged, the flusher must wake for it. it resets its
+        // wake time before it looks at st, so it either saw this task or is told
+        if (due < flusher_wakes_.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lg(stages_lk_);
+            flusher_cv_.notify_one();
+        }
+        return 0;
+    }
+
+    /// \internal queue the tasks of \p st if forced or the oldest is due
+    /// \return when what is still staged is due, UINT64_MAX if nothing is
+    uint64_t flush_stage(stage& st, const bool force, const uint64_t now) {
+        std::lock_guard<std::mutex> lg(st.lk);
+        if (st.pool.load(std::memory_order_relaxed) != this || st.tasks.empty())
+            return UINT64_MAX;
+        if (!force && now - st.first_ns < st.max_delay_ns)
+            return st.first_ns + st.max_delay_ns;
+        push_staged(st);
+        return UINT64_MAX;
+    }
+
+    /// \internal under st.lk
+    int push_staged(stage& st) {
+        std::vector<task_t> batch;
+        batch.swap(st.tasks);
+        st.tasks.reserve(st.capacity);
+        return push_batch(least_loaded(), batch);
+    }
+
+    /// \internal a thread stops staging to the pool of \p st, or exits
+    static void leave(stage& st) {
+        std::lock_guard<std::mutex> lg(st.lk);
+        ThreadPool* pool = st.pool.exchange(nullptr);
+        if (!pool)
+            return;
+        pool->n_staging_.fetch_sub(1, std::memory_order_relaxed);
+        if (!st.tasks.empty())
+            pool->push_staged(st);
+    }
+
+    /// \internal the flusher thread, queues the stages that are due. it
+    /// sleeps until the oldest staged task is due, or until one is staged
+    void flush_stages() {
+        std::unique_lock<std::mutex> lk(stages_lk_);
+        while (!flusher_quit_) {
+            flusher_wakes_.store(UINT64_MAX, std::memory_order_relaxed);
+            const uint64_t now = metrics_now_ns();
+            uint64_t due = UINT64_MAX;
+            for (size_t k=0; k<stages_.size();) {
+                if (!stages_[k]->pool.load(std::memory_order_relaxed)) {
+                    stages_[k] = stages_.back();    // the thread left
+                    stages_.pop_back();
+                    continue;
+                }
+                due = std::min(due, flush_stage(*stages_[k++], false, now));
+            }
+            flusher_wakes_.store(due, std::memory_order_relaxed);
+            if (due == UINT64_MAX) {
+                flusher_cv_.wait(lk);
+            } else {
+                flusher_cv_.wait_for(lk, std::chrono::nanoseconds(due - now));
+            }
+        }
+    }
+
+    void flush_all() {
+        std::lock_guard<std::mutex> lg(stages_lk_);
+        for (auto& st : stages_) {
+            flush_stage(*st, true, 0);
+        }
+    }
+
+    /// \internal detach the stages once the workers are gone, drop what was
+    /// staged since flush_all() and stop the flusher
+    /// \return the number of tasks dropped
+    size_t close_stages() {
+        size_t dropped = 0;
+        std::lock_guard<std::mutex> lg(stages_lk_);
+        for (auto& st : stages_) {
+            std::lock_guard<std::mutex> slg(st->lk);
+            if (st->pool.exchange(nullptr))
+                n_staging_.fetch_sub(1, std::memory_order_relaxed);
+            for (auto& task : st->tasks) {
+                Metrics::on_drop(task.event);
+                ++dropped;
+            }
+            st->tasks.clear();
+        }
+        stages_.clear();
+        flusher_quit_ = true;
+        flusher_cv_.notify_one();
+        return dropped;
+    }
+
+    void wake_all() {
         for (auto& sem : sems_) {
             sem.release();   // continue all the blocked threads
         }
     }
-private:
+
     void poll_events() {
+        live_ = n_threads_;
+        threads_.reserve(n_threads_);
         for (size_t i=0; i< n_threads_; ++i) {
             threads_.emplace_back([i, this]() {
-                while (!quit_) {
+                this_worker() = worker_id{this, i};
+                std::vector<task_t> batch;  // take_batch() clears it, keeps the room
+                batch.reserve(BATCH);
+                while (true) {
                     sems_[i].acquire();
-                    while (!tasks_[i].empty()) {
-                        auto task = tasks_[i].front();
-                        task->run();
-                        tasks_[i].pop();
+                    Tracer::record_event(Tracer::wakeup, 0, Metrics::NO_SLOT, i);
+                    while (state_ != stopping && take_batch(i, batch)) {
+                        run_batch(i, batch);
                     }
+                    if (state_ == stopping || (state_ == draining && idle(i)))
+                        break;
                 }
+                std::lock_guard<std::mutex> lg(live_lk_);
+                if (--live_ == 0)
+                    exited_.notify_all();
             });
         }
     }
+
+    /// \internal move up to BATCH tasks of queue \p i to \p batch, under one
+    /// lock. false if it's empty, the worker sleeps then until a push wakes it
+    bool take_batch(const size_t i, std::vector<task_t>& batch) {
+        batch.clear();
+        std::lock_guard<std::mutex> lg(lks_[i]);
+        auto& l = tasks_[i];
+        task_t task;
+        while (batch.size() < BATCH && l.pop(task)) {
+            batch.emplace_back(std::move(task));
+        }
+        l.claimed.store(batch.size(), std::memory_order_relaxed);
+        l.sleeping = batch.empty();
+        l.stuck = false;
+        return !batch.empty();
+    }
+
+    /// \internal run a batch taken by take_batch(). when the pool stops half
+    /// way, the rest goes back to the queue to be dropped with it
+    void run_batch(const size_t i, std::vector<task_t>& batch) {
+        auto& claimed = tasks_[i].claimed;
+        for (size_t k=0; k<batch.size(); ++k) {
+            if (state_ == stopping) {
+                std::lock_guard<std::mutex> lg(lks_[i]);
+                for (; k<batch.size(); ++k) {
+                    tasks_[i].push(std::move(batch[k]));
+                }
+                claimed.store(0, std::memory_order_relaxed);
+                break;
+            }
+#if defined(__GNUC__)
+            if (k + 1 < batch.size())
+                __builtin_prefetch(batch[k + 1].handle.get());
+#endif
+            task_t& task = batch[k];
+            Tracer::record_event(Tracer::dequeue, task.trace, task.event, i);
+            if (!task.start())
+                Metrics::on_cancel(task.event);
+            else if (task.deadline_ns && metrics_now_ns() > task.deadline_ns)
+                expire(i, task);
+            else
+                run(i, task);
+            task = task_t();    // release the handle now, not with the next batch
+            claimed.store(batch.size() - k - 1, std::memory_order_relaxed);
+        }
+    }
+
+    bool idle(const size_t i) {
+        std::lock_guard<std::mutex> lg(lks_[i]);
+        return tasks_[i].empty();
+    }
+
+    void expire(const size_t i, const task_t& task) {
+        Metrics::on_expire(task.event);
+        auto& c = counters_[i];
+        c.expired.store(c.expired.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (task.on_expire)
+            run_guarded(i, *task.on_expire, task.event);
+    }
+
+    void run(const size_t i, const task_t& task) {
+        Tracer::record_event(Tracer::run_begin, task.trace, task.event, i);
+        run_measured(i, task);
+        Tracer::record_event(Tracer::run_end, task.trace, task.event, i);
+    }
+
+    void run_measured(const size_t i, const task_t& task) {
+        auto& c = counters_[i];
+#if EVENT_MANAGER_METRICS
+        const bool cpu = cpu_time_.load(std::memory_order_relaxed);
+        const uint64_t cpu_start = cpu ? thread_cpu_ns() : 0;
+        uint64_t start = metrics_now_ns();
+        c.event.store(task.event, std::memory_order_relaxed);
+        c.since.store(start, std::memory_order_release);
+        run_guarded(i, *task.handle, task.event);
+        c.since.store(0, std::memory_order_relaxed);
+        uint64_t end = metrics_now_ns();
+        Metrics::on_run(task.event, start - task.enqueued_ns, end - start);
+        if (cpu)
+            Metrics::on_cpu(task.event, thread_cpu_ns() - cpu_start);
+        c.tasks.store(c.tasks.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        c.busy_ns.store(c.busy_ns.load(std::memory_order_relaxed) + end - start,
+                        std::memory_order_relaxed);
+#else
+        if (!watching_.load(std::memory_order_relaxed)) {
+            run_guarded(i, *task.handle, task.event);
+            return;
+        }
+        c.event.store(task.event, std::memory_order_relaxed);
+        c.since.store(metrics_now_ns(), std::memory_order_release);
+        run_guarded(i, *task.handle, task.event);
+        c.since.store(0, std::memory_order_relaxed);
+#endif
+    }
+
+    /// \internal run \p h on worker \p i, the task is out of the queue
+    /// already, so a throw only fails this run. the try costs nothing until
+    /// something is thrown
+    void run_guarded(const size_t i, handle_base& h, const uint32_t event) {
+        std::exception_ptr err;
+        try {
+            h.run();
+            return;
+        } catch (...) {
+            err = std::current_exception();
+        }
+        Metrics::on_fail(event);
+        auto& c = counters_[i];
+        c.failed.store(c.failed.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        if (auto f = std::atomic_load(&on_error_)) {
+            try {
+                (*f)(event, err);
+            } catch (...) {
+            }
+        }
+    }
+
+    static uint64_t thread_cpu_ns() {
+        timespec ts{};
+        clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+        return uint64_t(ts.tv_sec) * 1000000000u + ts.tv_nsec;
+    }
+
+    /// \internal the watchdog thread, see watch()
+    void watchdog() {
+        std::vector<uint64_t> flagged(n_threads_, 0);   // the since of the run flagged last
+        std::unique_lock<std::mutex> lk(watch_lk_);
+        while (!watch_quit_) {
+            if (!watch_ns_) {
+                watch_cv_.wait(lk);
+                continue;
+            }
+            watch_cv_.wait_for(lk, std::chrono::nanoseconds(watch_ns_ / 2));
+            if (watch_quit_ || !watch_ns_)
+                continue;
+            const uint64_t now = metrics_now_ns();
+            for (size_t i=0; i<n_threads_; ++i) {
+                auto& c = counters_[i];
+                uint64_t since = c.since.load(std::memory_order_acquire);
+                uint32_t event = c.event.load(std::memory_order_relaxed);
+                if (!since || since == flagged[i] || now - since < watch_ns_ ||
+                    c.since.load(std::memory_order_acquire) != since)
+                    continue;
+                flagged[i] = since;
+                Metrics::on_slow(event);
+                if (move_queue_ && n_threads_ > 1)
+                    move_queue(i);
+                if (on_slow_)
+                    on_slow_(i, event, now - since);
+            }
+        }
+    }
+
+    /// \internal mark worker \p i stuck and spread its queue over the others
+    void move_queue(const size_t i) {
+        std::vector<task_t> moved;
+        {
+            std::lock_guard<std::mutex> lg(lks_[i]);
+            if (!accepting_)
+                return;     // shutting down, they would be dropped
+            tasks_[i].stuck = true;
+            task_t task;
+            while (tasks_[i].pop(task)) {
+                moved.emplace_back(std::move(task));
+            }
+        }
+        if (moved.empty())
+            return;
+        auto& c = counters_[i];
+        c.moved.store(c.moved.load(std::memory_order_relaxed) + moved.size(),
+                      std::memory_order_relaxed);
+        // round robin from the least loaded, so no one worker gets it all
+        std::vector<std::vector<task_t>> to(n_threads_);
+        size_t j = least_loaded();
+        for (auto& task : moved) {
+            to[j].emplace_back(std::move(task));
+            do {
+                j = (j + 1) % n_threads_;
+            } while (j == i);
+        }
+        for (j=0; j<n_threads_; ++j) {
+            if (!to[j].empty())
+                push_batch(j, to[j]);
+        }
+    }
+
+    void stop_watchdog() {
+        {
+            std::lock_guard<std::mutex> lg(watch_lk_);
+            watch_quit_ = true;
+            watching_.store(false, std::memory_order_relaxed);
+            watch_cv_.notify_one();
+        }
+        if (watchdog_.joinable())
+            watchdog_.join();
+    }
 };
 
 class TaskFlow {
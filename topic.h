@@ -0,0 +1,228 @@
+//
+// Created by zelin on 2022/7/4.
+//
+
+#ifndef EVENT_MANAGER_TOPIC_H
+#define EVENT_MANAGER_TOPIC_H
+
+#include "noncopyable.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+/// hierarchical topics: levels separated by '.', e.g. "sensor.kitchen.temperature".
+/// a pattern level may be '*' for exactly one level, or '#' for zero or more:
+///   "sensor.*.temperature" matches "sensor.kitchen.temperature"
+///   "sensor.#"             matches "sensor", "sensor.kitchen.temperature"
+/// empty levels are not allowed.
+inline bool topic_split(const std::string& topic, std::vector<std::string>& levels) {
+    levels.clear();
+    size_t begin = 0;
+    while (true) {
+        size_t end = topic.find('.', begin);
+        if (end == std::string::npos)
+            end = topic.size();
+        if (end == begin)
+            return false;
+        levels.emplace_back(topic, begin, end - begin);
+        if (end == topic.size())
+            return true;
+        begin = end + 1;
+    }
+}
+
+/// the patterns, as a trie of their levels. matching a topic walks the exact
+/// child, the '*' child and the '#' child of each node, so the cost depends on
+/// the topic depth and the wildcards on the way, not on the number of patterns.
+/// not thread safe, see TopicIndex
+class TopicTrie {
+private:
+    struct node {
+        std::unordered_map<std::string, std::unique_ptr<node>> children;
+        std::unique_ptr<node> star;
+        std::unique_ptr<node> hash;
+        std::vector<uint64_t> ids;
+
+        bool empty() const {
+            return children.empty() && !star && !hash && ids.empty();
+        }
+    };
+
+    node root_;
+
+public:
+    /// \return false if \p pattern is not valid
+    bool add(const std::string& pattern, const uint64_t id) {
+        std::vector<std::string> levels;
+        if (!topic_split(pattern, levels))
+            return false;
+        node* n = &root_;
+        for (auto& l : levels) {
+            auto& next = l == "*" ? n->star : l == "#" ? n->hash : n->children[l];
+            if (!next)
+                next.reset(new node);
+            n = next.get();
+        }
+        n->ids.push_back(id);
+        return true;
+    }
+
+    void remove(const std::string& pattern, const uint64_t id) {
+        std::vector<std::string> levels;
+        if (topic_split(pattern, levels))
+            remove(&root_, levels, 0, id);
+    }
+
+    /// append the ids of the patterns matching \p topic to \p out, each once
+    void match(const std::string& topic, std::vector<uint64_t>& out) const {
+        std::vector<std::string> levels;
+        if (!topic_split(topic, levels))
+            return;
+        size_t begin = out.size();
+        match(&root_, levels, 0, out);
+        std::sort(out.begin() + begin, out.end());
+        out.erase(std::unique(out.begin() + begin, out.end()), out.end());
+    }
+
+private:
+    /// \internal \return whether \p n became empty
+    static bool remove(node* n, const std::vector<std::string>& levels, size_t i,
+                       const uint64_t id) {
+        if (i == levels.size()) {
+            auto it = std::find(n->ids.begin(), n->ids.end(), id);
+            if (it != n->ids.end())
+                n->ids.erase(it);
+            return n->empty();
+        }
+        const auto& l = levels[i];
+        if (l == "*" || l == "#") {
+            auto& child = l == "*" ? n->star : n->hash;
+            if (child && remove(child.get(), levels, i + 1, id))
+                child.reset();
+        } else {
+            auto it = n->children.find(l);
+            if (it != n->children.end() && remove(it->second.get(), levels, i + 1, id))
+                n->children.erase(it);
+        }
+        return n->empty();
+    }
+
+    static void match(const node* n, const std::vector<std::string>& levels, size_t i,
+                      std::vector<uint64_t>& out) {
+        if (n->hash) {
+            // '#' takes levels i .. k-1, zero or more of them
+            for (size_t k=i; k<=levels.size(); ++k) {
+                match(n->hash.get(), levels, k, out);
+            }
+        }
+        if (i == levels.size()) {
+            out.insert(out.end(), n->ids.begin(), n->ids.end());
+            return;
+        }
+        auto it = n->children.find(levels[i]);
+        if (it != n->children.end())
+            match(it->second.get(), levels, i + 1, out);
+        if (n->star)
+            match(n->star.get(), levels, i + 1, out);
+    }
+};
+
+/// thread safe subscriptions of \tparam V by pattern, with a cache of the
+/// match results per concrete topic. the cache is dropped whenever the
+/// subscriptions change, and when it grows past max_cached
+template <typename V>
+class TopicIndex : public noncopyable {
+public:
+    using match_t = std::shared_ptr<const std::vector<V>>;
+
+private:
+    mutable std::shared_mutex lk_;
+    TopicTrie trie_;
+    std::unordered_map<uint64_t, std::pair<std::string, V>> subs_;
+    uint64_t next_id_ = 0;
+
+    mutable std::shared_mutex cache_lk_;
+    mutable std::unordered_map<std::string, match_t> cache_;
+    size_t max_cached_;
+
+public:
+    explicit TopicIndex(const size_t max_cached = 65536) :
+            max_cached_(max_cached) {}
+
+    /// \return the subscription id, -1 if \p pattern is not valid
+    int64_t subscribe(const std::string& pattern, V v) {
+        std::unique_lock<std::shared_mutex> lk(lk_);
+        uint64_t id = next_id_;
+        if (!trie_.add(pattern, id))
+            return -1;
+        ++next_id_;
+        subs_.emplace(id, std::make_pair(pattern, std::move(v)));
+        clear_cache();
+        return static_cast<int64_t>(id);
+    }
+
+    /// \return 0, -1 if there is no such subscription
+    int unsubscribe(const int64_t id) {
+        std::unique_lock<std::shared_mutex> lk(lk_);
+        auto it = subs_.find(static_cast<uint64_t>(id));
+        if (it == subs_.end())
+            return -1;
+        trie_.remove(it->second.first, it->first);
+        subs_.erase(it);
+        clear_cache();
+        return 0;
+    }
+
+    /// the subscriptions matching the concrete \p topic, never null
+    match_t match(const std::string& topic) const {
+        {
+            std::shared_lock<std::shared_mutex> lg(cache_lk_);
+            auto it = cache_.find(topic);
+            if (it != cache_.end())
+                return it->second;
+        }
+        std::shared_lock<std::shared_mutex> lk(lk_);
+        std::vector<uint64_t> ids;
+        trie_.match(topic, ids);
+        auto result = std::make_shared<std::vector<V>>();
+        result->reserve(ids.size());
+        for (auto id : ids) {
+            result->push_back(subs_.at(id).second);
+        }
+        // still under lk_, so no subscribe() cleared the cache since the match
+        std::unique_lock<std::shared_mutex> lg(cache_lk_);
+        if (cache_.size() >= max_cached_)
+            cache_.clear();
+        cache_.emplace(topic, result);
+        return result;
+    }
+
+    /// call \p f(pattern, v) for every subscription
+    template <typename Func>
+    void for_each(Func&& f) const {
+        std::shared_lock<std::shared_mutex> lk(lk_);
+        for (auto& s : subs_) {
+            f(s.second.first, s.second.second);
+        }
+    }
+
+    size_t size() const {
+        std::shared_lock<std::shared_mutex> lk(lk_);
+        return subs_.size();
+    }
+
+private:
+    void clear_cache() {
+        std::unique_lock<std::shared_mutex> lg(cache_lk_);
+        cache_.clear();
+    }
+};
+
+#endif //EVENT_MANAGER_TOPIC_H
@@ -0,0 +1,284 @@
+//
+// Created by zelin on 2022/6/14.
+//
+
+#ifndef EVENT_MANAGER_TRACE_H
+#define EVENT_MANAGER_TRACE_H
+
+/// build with -DEVENT_MANAGER_NO_TRACE to compile the tracer out completely.
+/// compiled in, it costs one branch per trace point until Tracer::enable()
+#ifndef EVENT_MANAGER_NO_TRACE
+#define EVENT_MANAGER_TRACE 1
+#else
+#define EVENT_MANAGER_TRACE 0
+#endif
+
+#include "metrics.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include <unistd.h>
+
+using trace_clock = std::chrono::steady_clock;
+
+/// records the dispatch of every task into per thread rings, and dumps them as
+/// chrome trace json (chrome://tracing, ui.perfetto.dev).
+///
+/// each thread writes only its own ring, so recording is a few plain stores.
+/// the rings keep the latest records, older ones are overwritten.
+/// dump() while the pool is busy may show a few torn records at the ring ends.
+///
+/// \code
+/// Tracer::enable();
+/// ... trigger things ...
+/// ep.dump_trace("trace.json");   // or Tracer::dump_on_terminate("trace.json")
+/// \endcode
+class Tracer {
+public:
+    enum kind_t : uint8_t {
+        trigger,    ///< event_pool got a trigger
+        enqueue,    ///< the task is in a worker's queue
+        wakeup,     ///< a worker returned from its semaphore
+        dequeue,    ///< a worker took the task
+        run_begin,
+        run_end,
+    };
+
+    static const size_t DEFAULT_RING = 1 << 16;     ///< records per thread
+
+private:
+    struct record {
+        uint64_t ts;
+        uint64_t task;
+        uint32_t event;
+        uint32_t worker;
+        kind_t kind;
+    };
+
+    struct ring {
+        const size_t mask;
+        const uint32_t tid;
+        std::unique_ptr<record[]> records;
+        std::atomic<uint64_t> head{0};
+
+        ring(const size_t size, const uint32_t tid) :
+                mask(size - 1),
+                tid(tid),
+                records(new record[size]) {}
+    };
+
+    struct state {
+        std::mutex lk;
+        std::vector<std::shared_ptr<ring>> rings;
+        size_t ring_size = DEFAULT_RING;
+        std::string dump_path;
+        uint64_t tsc0 = 0;
+        trace_clock::time_point t0;
+    };
+
+    inline static std::atomic<bool> on_{false};
+    inline static std::atomic<uint64_t> next_task_{1};
+
+    static state& st() {
+        static auto s = new state;      // leaked, threads may exit after main
+        return *s;
+    }
+
+    static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+        return __rdtsc();
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                trace_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    /// \internal the ring of this thread, the rings outlive their thread so
+    /// a dump still shows what exited workers did
+    static ring& mine() {
+        static thread_local std::shared_ptr<ring> r = [] {
+            auto& s = st();
+            std::lock_guard<std::mutex> lg(s.lk);
+            auto p = std::make_shared<ring>(s.ring_size, static_cast<uint32_t>(gettid()));
+            s.rings.push_back(p);
+            return p;
+        }();
+        return *r;
+    }
+
+public:
+    /// start recording, \p ring_size (a power of 2) applies to threads that
+    /// have not recorded anything yet
+    static void enable(const size_t ring_size = DEFAULT_RING) {
+#if EVENT_MANAGER_TRACE
+        auto& s = st();
+        {
+            std::lock_guard<std::mutex> lg(s.lk);
+            s.ring_size = ring_size && !(ring_size & (ring_size - 1)) ? ring_size : DEFAULT_RING;
+            if (!s.tsc0) {
+                s.tsc0 = ticks();
+                s.t0 = trace_clock::now();
+            }
+        }
+        on_.store(true, std::memory_order_relaxed);
+#endif
+    }
+
+    static void disable() {
+        on_.store(false, std::memory_order_relaxed);
+    }
+
+    static bool on() {
+#if EVENT_MANAGER_TRACE
+        return __builtin_expect(on_.load(std::memory_order_relaxed), 0);
+#else
+        return false;
+#endif
+    }
+
+    /// an id to follow a task through the pool, 0 while disabled
+    static uint64_t new_task() {
+        return on() ? next_task_.fetch_add(1, std::memory_order_relaxed) : 0;
+    }
+
+    static void record_event(const kind_t kind, const uint64_t task, const uint32_t event,
+                             const uint32_t worker = UINT32_MAX) {
+        if (!on())
+            return;
+        auto& r = mine();
+        uint64_t h = r.head.load(std::memory_order_relaxed);
+        r.records[h & r.mask] = record{ticks(), task, event, worker, kind};
+        r.head.store(h + 1, std::memory_order_release);
+    }
+
+    /// dump() to \p path from event_pool::terminate()
+    static void dump_on_terminate(const std::string& path) {
+        std::lock_guard<std::mutex> lg(st().lk);
+        st().dump_path = path;
+    }
+
+    static std::string terminate_path() {
+        std::lock_guard<std::mutex> lg(st().lk);
+        return st().dump_path;
+    }
+
+    /// forget everything recorded so far
+    static void clear() {
+        auto& s = st();
+        std::lock_guard<std::mutex> lg(s.lk);
+        for (auto& r : s.rings) {
+            r->head.store(0);
+        }
+    }
+
+    /// write all the rings as chrome trace json to \p path.
+    /// \p names maps event (metrics) slots to event ids.
+    /// \return 0 on success, -1 if the file can't be written
+    static int dump(const std::string& path,
+                    const std::unordered_map<uint32_t, std::string>& names = {}) {
+        FILE* f = fopen(path.c_str(), "w");
+        if (!f)
+            return -1;
+        dump(f, names);
+        return fclose(f) ? -1 : 0;
+    }
+
+    static void dump(FILE* f, const std::unordered_map<uint32_t, std::string>& names = {}) {
+        auto& s = st();
+        std::lock_guard<std::mutex> lg(s.lk);
+
+        // tsc -> us since enable()
+        double us_per_tick = 1e-3;
+#if defined(__x86_64__) || defined(__i386__)
+        uint64_t tsc1 = ticks();
+        double ns = std::chrono::duration<double, std::nano>(trace_clock::now() - s.t0).count();
+        if (tsc1 > s.tsc0 && ns > 0)
+            us_per_tick = ns / double(tsc1 - s.tsc0) * 1e-3;
+#endif
+        auto us = [&](uint64_t ts) {
+            return ts > s.tsc0 ? double(ts - s.tsc0) * us_per_tick : 0.0;
+        };
+        auto name = [&names](uint32_t event) {
+            auto it = names.find(event);
+            return it != names.end() ? json_escape(it->second)
+                                     : "event " + std::to_string(event);
+        };
+
+        const int pid = getpid();
+        fprintf(f, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+        bool first = true;
+        auto sep = [&first]() {
+            const char* s = first ? "" : ",\n";
+            first = false;
+            return s;
+        };
+        for (auto& r : s.rings) {
+            uint64_t head = r->head.load(std::memory_order_acquire);
+            uint64_t begin = head > r->mask + 1 ? head - r->mask - 1 : 0;
+            fprintf(f, "%s{\"ph\":\"M\",\"name\":\"thread_name\",\"pid\":%d,\"tid\":%u,"
+                       "\"args\":{\"name\":\"thread %u\"}}", sep(), pid, r->tid, r->tid);
+            const record* trig = nullptr;     // the trigger waiting for its enqueue
+            const record* beg = nullptr;
+            for (uint64_t i=begin; i<head; ++i) {
+                const record& rec = r->records[i & r->mask];
+                switch (rec.kind) {
+                case trigger:
+                    trig = &rec;
+                    break;
+                case enqueue:
+                    fprintf(f, "%s{\"ph\":\"X\",\"name\":\"trigger %s\",\"cat\":\"trigger\","
+                               "\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                               "\"args\":{\"task\":%llu,\"worker\":%u}}",
+                            sep(), name(rec.event).c_str(), pid, r->tid,
+                            us(trig ? trig->ts : rec.ts),
+                            trig ? us(rec.ts) - us(trig->ts) : 0.0,
+                            (unsigned long long) rec.task, rec.worker);
+                    fprintf(f, "%s{\"ph\":\"s\",\"name\":\"queue\",\"cat\":\"queue\",\"id\":%llu,"
+                               "\"pid\":%d,\"tid\":%u,\"ts\":%.3f}",
+                            sep(), (unsigned long long) rec.task, pid, r->tid, us(rec.ts));
+                    trig = nullptr;
+                    break;
+                case wakeup:
+                    fprintf(f, "%s{\"ph\":\"i\",\"s\":\"t\",\"name\":\"wakeup\",\"pid\":%d,"
+                               "\"tid\":%u,\"ts\":%.3f}", sep(), pid, r->tid, us(rec.ts));
+                    break;
+                case dequeue:
+                    fprintf(f, "%s{\"ph\":\"f\",\"bp\":\"e\",\"name\":\"queue\",\"cat\":\"queue\","
+                               "\"id\":%llu,\"pid\":%d,\"tid\":%u,\"ts\":%.3f}",
+                            sep(), (unsigned long long) rec.task, pid, r->tid, us(rec.ts));
+                    break;
+                case run_begin:
+                    beg = &rec;
+                    break;
+                case run_end:
+                    if (!beg || beg->task != rec.task)
+                        break;
+                    fprintf(f, "%s{\"ph\":\"X\",\"name\":\"%s\",\"cat\":\"run\",\"pid\":%d,"
+                               "\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f,"
+                               "\"args\":{\"task\":%llu,\"worker\":%u}}",
+                            sep(), name(rec.event).c_str(), pid, r->tid, us(beg->ts),
+                            us(rec.ts) - us(beg->ts), (unsigned long long) rec.task, rec.worker);
+                    beg = nullptr;
+                    break;
+                }
+            }
+        }
+        fprintf(f, "\n]}\n");
+    }
+};
+
+#endif //EVENT_MANAGER_TRACE_H
@@ -0,0 +1,246 @@
+//
+// Created by zelin on 2022/7/22.
+//
+
+#ifndef EVENT_MANAGER_TRIGGERLOG_H
+#define EVENT_MANAGER_TRIGGERLOG_H
+
+#include "handle.h"
+#include "metrics.h"
+#include "noncopyable.h"
+
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// an append-only log of triggers in a memory mapped file: (time, kind,
+/// event id, packed args) records, see event_pool::record() and
+/// event_pool::replay().
+///
+/// the file is sized to its capacity up front, so appending is a CAS loop
+/// that moves the tail on only while the record fits, and a memcpy, from
+/// any number of threads. once it is full the records are dropped and
+/// counted, the tail never passes the capacity. only trivially copyable args
+/// are recorded, see pack_args()
+class TriggerLog : public noncopyable {
+public:
+    /// how the trigger came in, replayed the same way
+    enum kind_t : uint8_t {
+        trigger,        ///< trigger_callback() and the like
+        trigger_set,    ///< trigger_and_set(), replayed as a trigger with the args
+        publish,        ///< publish(), the id is the topic
+        compact,        ///< trigger_compact()
+    };
+
+    static const uint8_t HAS_ARGS = 1;    ///< else it ran with the registered args
+
+    /// one record as read back, the pointers are valid while the log is open
+    struct record_t {
+        uint64_t time_ns;       ///< since the log was created
+        kind_t kind;
+        bool has_args;
+        const char* id;
+        size_t id_len;
+        const void* payload;
+        size_t payload_len;
+    };
+
+private:
+    static const uint32_t MAGIC = 0x6570746c;   // "eptl"
+
+    struct header {
+        uint32_t magic;
+        uint32_t version;
+        uint64_t capacity;          ///< bytes of records after the header
+        std::atomic<uint64_t> tail; ///< bytes reserved so far
+        std::atomic<uint64_t> dropped;
+    };
+
+    struct rec {
+        std::atomic<uint32_t> size; ///< with padding, written last, 0 until then
+        uint8_t kind;
+        uint8_t flags;
+        uint16_t id_len;
+        uint64_t time_ns;
+        uint32_t payload_len;
+        uint32_t pad;               ///< the size, until it is stored to size
+        // followed by the id, then the packed args
+    };
+
+    int fd_ = -1;
+    bool writable_ = false;
+    size_t bytes_ = 0;
+    header* hdr_ = nullptr;
+    char* data_ = nullptr;
+    uint64_t start_ns_ = 0;
+
+public:
+    /// create (truncate) \p path to record into, with room for \p capacity
+    /// bytes of records. throws std::system_error on failure
+    TriggerLog(const std::string& path, const size_t capacity) :
+            writable_(true) {
+        fd_ = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::system_category(), "open " + path);
+        bytes_ = sizeof(header) + capacity;
+        if (ftruncate(fd_, bytes_) < 0)
+            fail("ftruncate");
+        map(PROT_READ | PROT_WRITE);
+        hdr_->version = 1;
+        hdr_->capacity = capacity;
+        hdr_->tail.store(0);
+        hdr_->dropped.store(0);
+        hdr_->magic = MAGIC;
+        start_ns_ = metrics_now_ns();
+    }
+
+    /// open \p path to read back. throws std::system_error if it can't be
+    /// opened, std::runtime_error if it is not a trigger log
+    explicit TriggerLog(const std::string& path) {
+        fd_ = ::open(path.c_str(), O_RDONLY);
+        if (fd_ < 0)
+            throw std::system_error(errno, std::system_category(), "open " + path);
+        struct stat st{};
+        if (fstat(fd_, &st) < 0)
+            fail("fstat");
+        bytes_ = st.st_size;
+        if (bytes_ < sizeof(header)) {
+            ::close(fd_);
+            throw std::runtime_error("not a trigger log: " + path);
+        }
+        map(PROT_READ);
+        if (hdr_->magic != MAGIC ||
+            bytes_ < sizeof(header) + std::min(hdr_->tail.load(), hdr_->capacity)) {
+            munmap(hdr_, bytes_);
+            ::close(fd_);
+            throw std::runtime_error("not a trigger log: " + path);
+        }
+    }
+
+    /// a written log is cut to what was recorded. stop the recording threads
+    /// first, a record still being written is lost
+    ~TriggerLog() {
+        uint64_t used = writable_ ? std::min(hdr_->tail.load(), hdr_->capacity) : 0;
+        munmap(hdr_, bytes_);
+        if (writable_ && ftruncate(fd_, sizeof(header) + used) < 0) {
+            // keeps its full size, the reader stops at the tail anyway
+        }
+        ::close(fd_);
+    }
+
+    /// append a trigger of \p id, with \p args unless has_args is false.
+    /// \return false if the log is full
+    template <typename ...Args>
+    bool append(const kind_t kind, std::string_view id, const bool has_args,
+                const Args&... args) {
+        static_assert(is_trivially_packable<Args...>::value,
+                      "only trivially copyable args can be recorded");
+        rec* r = reserve(kind, id, has_args, packed_size<Args...>());
+        if (!r)
+            return false;
+        if constexpr (sizeof...(Args) > 0)
+            pack_args(reinterpret_cast<char*>(r + 1) + id.size(), args...);
+        r->size.store(r->pad, std::memory_order_release);
+        return true;
+    }
+
+    /// append() with the args already packed
+    bool append_bytes(const kind_t kind, std::string_view id,
+                      const void* payload, const size_t len) {
+        rec* r = reserve(kind, id, true, len);
+        if (!r)
+            return false;
+        std::memcpy(reinterpret_cast<char*>(r + 1) + id.size(), payload, len);
+        r->size.store(r->pad, std::memory_order_release);
+        return true;
+    }
+
+    /// count a trigger that could not be recorded, e.g. its args are not
+    /// trivially copyable
+    void drop() {
+        hdr_->dropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /// call \p f(const record_t&) for every record in order, stops at one
+    /// that was never finished. \return the number of records
+    template <typename Func>
+    size_t for_each(Func&& f) const {
+        const uint64_t end = std::min(hdr_->tail.load(std::memory_order_acquire), hdr_->capacity);
+        size_t n = 0;
+        for (uint64_t at=0; at + sizeof(rec) <= end; ++n) {
+            auto r = reinterpret_cast<const rec*>(data_ + at);
+            uint32_t size = r->size.load(std::memory_order_acquire);
+            if (!size || at + size > end)
+                break;
+            auto p = reinterpret_cast<const char*>(r + 1);
+            f(record_t{r->time_ns, static_cast<kind_t>(r->kind), bool(r->flags & HAS_ARGS),
+                       p, r->id_len, p + r->id_len, r->payload_len});
+            at += size;
+        }
+        return n;
+    }
+
+    /// records that did not fit
+    uint64_t dropped() const {
+        return hdr_->dropped.load(std::memory_order_relaxed);
+    }
+
+    /// bytes of records written
+    uint64_t used() const {
+        return std::min(hdr_->tail.load(std::memory_order_relaxed), hdr_->capacity);
+    }
+
+private:
+    /// \internal room for a record with \p n bytes of args, its header and id
+    /// written. nullptr if it does not fit
+    rec* reserve(const kind_t kind, std::string_view id, const bool has_args, const size_t n) {
+        if (id.size() > UINT16_MAX || n > UINT32_MAX) {
+            drop();
+            return nullptr;
+        }
+        const size_t size = (sizeof(rec) + id.size() + n + 7) & ~size_t(7);
+        // never past the capacity, so the tail is always what was written
+        uint64_t at = hdr_->tail.load(std::memory_order_relaxed);
+        do {
+            if (at + size > hdr_->capacity) {
+                drop();
+                return nullptr;
+            }
+        } while (!hdr_->tail.compare_exchange_weak(at, at + size, std::memory_order_relaxed));
+        auto r = reinterpret_cast<rec*>(data_ + at);
+        r->kind = kind;
+        r->flags = has_args ? HAS_ARGS : 0;
+        r->id_len = static_cast<uint16_t>(id.size());
+        r->time_ns = metrics_now_ns() - start_ns_;
+        r->payload_len = static_cast<uint32_t>(n);
+        r->pad = static_cast<uint32_t>(size);
+        std::memcpy(reinterpret_cast<char*>(r + 1), id.data(), id.size());
+        return r;
+    }
+
+    void map(const int prot) {
+        void* p = mmap(nullptr, bytes_, prot, MAP_SHARED, fd_, 0);
+        if (p == MAP_FAILED)
+            fail("mmap");
+        hdr_ = static_cast<header*>(p);
+        data_ = static_cast<char*>(p) + sizeof(header);
+    }
+
+    [[noreturn]] void fail(const char* what) {
+        int err = errno;
+        ::close(fd_);
+        throw std::system_error(err, std::system_category(), what);
+    }
+};
+
+#endif //EVENT_MANAGER_TRIGGERLOG_H